@@ -0,0 +1,180 @@
+#include "midi-merger.h"
+#include "mock-midiport.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+/*
+ * Microbenchmark of `merger_process_callback()` against the mock MIDI
+ * buffers. It sweeps the number of sources, events per cycle, event
+ * size and how full the output buffer gets, e.g.
+ *
+ *   $ mod-midi-merger-bench [milliseconds per case]
+ */
+
+static const jack_nframes_t nframes = 128;
+
+/* a roomy buffer, the Jack2 default for MIDI ports is 32 kB */
+static const size_t roomy_buffer_size = 32768;
+
+typedef struct BENCH_CASE_T {
+  int sources;
+  int events;
+  size_t event_size;
+  // Output buffer size relative to the size of all events, in percent,
+  // not counting the headroom of `overflow=protect`.
+  int fill;
+} bench_case_t;
+
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+
+/**
+ * Fill a port with `count` events spread over the cycle. Events of
+ * more than three bytes are SysEx.
+ */
+static void fill_port(jack_port_t *port, int count, size_t event_size) {
+  jack_midi_data_t data[1024];
+  void *const buffer = jack_port_get_buffer(port, nframes);
+
+  if (event_size > 3) {
+    data[0] = 0xf0;
+    memset(data + 1, 0x7d, event_size - 2);
+    data[event_size - 1] = 0xf7;
+  } else {
+    data[0] = 0x90;
+    data[1] = 60;
+    data[2] = 100;
+  }
+
+  jack_midi_clear_buffer(buffer);
+  for (int i = 0; i < count; ++i) {
+    jack_midi_event_write(buffer, (jack_nframes_t) (i * (int) nframes / count),
+                          data, event_size);
+  }
+}
+
+
+static void run_case(const bench_case_t *bench, uint64_t duration_ns) {
+  const int per_source = bench->events / bench->sources;
+  const size_t event_cost = 12 + (bench->event_size > 4 ? bench->event_size : 0);
+  const size_t total_cost = event_cost * (size_t) (per_source * bench->sources);
+
+  midi_merger_t *const mm = calloc(1, sizeof(midi_merger_t));
+  mm->config = malloc(sizeof(merger_config_t));
+  merger_config_init(mm->config);
+
+  // The headroom of the overflow policy comes on top.
+  const size_t output_size = total_cost * (size_t) bench->fill / 100
+                           + (mm->config->overflow == OVERFLOW_PROTECT
+                              ? (size_t) mm->config->headroom : 0);
+  mm->config->per_source = bench->sources > 1;
+  controller_slots_init(&mm->overflow_slots);
+  controller_slots_init(&mm->coalesce_slots);
+  controller_slots_init(&mm->throttle_slots);
+  // Only the log and the wakeups of the core are used by the callback.
+  midi_core_t core;
+  rt_log_init(&core.log);
+  sem_init(&core.sem, 0, 0);
+  mm->core = &core;
+  mm->stats = merger_stats_create(NULL);
+  mm->sample_rate = 48000;
+  mm->clock_master = -1;
+
+  mm->ports[PORT_IN] = mock_port_create(roomy_buffer_size);
+  mm->ports[PORT_OUT] = mock_port_create(output_size > 0 ? output_size : 1);
+  if (mm->config->per_source) {
+    for (int i = 0; i < bench->sources; ++i) {
+      mm->sources[i].port = mock_port_create(roomy_buffer_size);
+      fill_port(mm->sources[i].port, per_source, bench->event_size);
+    }
+    mm->num_sources = bench->sources;
+  } else {
+    fill_port(mm->ports[PORT_IN], per_source, bench->event_size);
+  }
+
+  // Warm up caches and branch predictors.
+  for (int i = 0; i < 1000; ++i) {
+    merger_process_callback(nframes, mm);
+  }
+  memset(&mm->process_stats, 0, sizeof(merger_process_stats_t));
+
+  uint64_t cycles = 0;
+  const uint64_t start = now_ns();
+  uint64_t elapsed = 0;
+  do {
+    for (int i = 0; i < 100; ++i) {
+      merger_process_callback(nframes, mm);
+    }
+    cycles += 100;
+    elapsed = now_ns() - start;
+  } while (elapsed < duration_ns);
+
+  // Drain the log, nobody else reads it here.
+  FILE *const devnull = fopen("/dev/null", "w");
+  if (devnull) {
+    rt_log_flush(&core.log, devnull);
+    fclose(devnull);
+  }
+
+  const merger_process_stats_t *const stats = &mm->process_stats;
+  uint64_t drops = 0;
+  for (int i = 0; i < DROP_REASON_COUNT; ++i) {
+    drops += stats->drops[i];
+  }
+
+  printf("%7d %7d %6zu %5d%% %10.1f %10.1f %10.2f\n",
+         bench->sources, per_source * bench->sources, bench->event_size, bench->fill,
+         stats->events_in > 0 ? (double) elapsed / (double) stats->events_in : 0.0,
+         (double) elapsed / (double) cycles,
+         (double) drops / (double) cycles);
+
+  for (int i = 0; i < mm->num_sources; ++i) {
+    mock_port_destroy(mm->sources[i].port);
+  }
+  mock_port_destroy(mm->ports[PORT_IN]);
+  mock_port_destroy(mm->ports[PORT_OUT]);
+  merger_stats_destroy(mm->stats, NULL);
+  sem_destroy(&core.sem);
+  free(mm->config);
+  free(mm);
+}
+
+
+int main(int argc, char **argv) {
+  const int milliseconds = argc > 1 ? atoi(argv[1]) : 100;
+  const uint64_t duration_ns = (uint64_t) (milliseconds > 0 ? milliseconds : 100) * 1000000;
+
+  static const int sources[] = { 1, 4, 16 };
+  static const int events[] = { 1, 16, 128, 512 };
+  static const size_t sizes[] = { 3, 256 };
+  static const int fills[] = { 200, 100, 50 };
+
+  printf("%7s %7s %6s %6s %10s %10s %10s\n",
+         "sources", "events", "bytes", "fill", "ns/event", "ns/cycle", "drops/cyc");
+
+  for (size_t s = 0; s < sizeof(sources) / sizeof(sources[0]); ++s) {
+    for (size_t e = 0; e < sizeof(events) / sizeof(events[0]); ++e) {
+      if (events[e] < sources[s]) {
+        continue;
+      }
+      for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); ++z) {
+        // Big SysEx bursts don't fit the input buffers.
+        if (sizes[z] * (size_t) events[e] / (size_t) sources[s] > roomy_buffer_size / 2) {
+          continue;
+        }
+        for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); ++f) {
+          const bench_case_t bench = { sources[s], events[e], sizes[z], fills[f] };
+          run_case(&bench, duration_ns);
+        }
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* --------------------------------------------------------------------- */
+// Fixed-size table of the latest value per continuous controller key
+
+/* number of slots, the hash table has twice as many buckets */
+#define CONTROLLER_SLOTS 64
+#define CONTROLLER_BUCKETS (2 * CONTROLLER_SLOTS)
+
+typedef struct CONTROLLER_SLOT_T {
+    uint16_t key;
+    uint16_t bucket;
+    uint32_t time;
+    uint8_t size;
+    uint8_t data[3];
+    // Where the value came from: source, its priority and the event
+    // index in the source buffer.
+    uint8_t source;
+    int32_t priority;
+    uint32_t index;
+} controller_slot_t;
+
+/**
+ * Slots are kept in order of insertion, lookups go through an open
+ * addressing hash table. All operations are bounded by the number of
+ * slots and don't allocate.
+ */
+typedef struct CONTROLLER_SLOTS_T {
+    uint32_t count;
+    int16_t buckets[CONTROLLER_BUCKETS];
+    controller_slot_t slots[CONTROLLER_SLOTS];
+} controller_slots_t;
+
+static inline
+void controller_slots_init(controller_slots_t* table)
+{
+    table->count = 0;
+    memset(table->buckets, 0xff, sizeof(table->buckets));
+}
+
+/**
+ * Remove all slots, in time proportional to the slots in use.
+ */
+static inline
+void controller_slots_reset(controller_slots_t* table)
+{
+    for (uint32_t i = 0; i < table->count; ++i)
+        table->buckets[table->slots[i].bucket] = -1;
+    table->count = 0;
+}
+
+/**
+ * Return the slot of `key` or NULL if there is none.
+ */
+static inline
+controller_slot_t* controller_slots_find(controller_slots_t* table, uint16_t key)
+{
+    uint32_t bucket = (((uint32_t) key * 40503u) >> 9) & (CONTROLLER_BUCKETS - 1);
+
+    for (int probes = 0; probes < CONTROLLER_BUCKETS; ++probes)
+    {
+        const int16_t index = table->buckets[bucket];
+
+        if (index < 0)
+            return NULL;
+        if (table->slots[index].key == key)
+            return &table->slots[index];
+
+        bucket = (bucket + 1) & (CONTROLLER_BUCKETS - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Return the slot of `key`, adding it if needed, or NULL if the table
+ * is full. `added` tells if the slot is new.
+ */
+static inline
+controller_slot_t* controller_slots_get(controller_slots_t* table, uint16_t key, bool* added)
+{
+    // Multiplicative hashing spreads channels and controller numbers.
+    uint32_t bucket = (((uint32_t) key * 40503u) >> 9) & (CONTROLLER_BUCKETS - 1);
+
+    for (int probes = 0; probes < CONTROLLER_BUCKETS; ++probes)
+    {
+        const int16_t index = table->buckets[bucket];
+
+        if (index < 0)
+        {
+            if (table->count == CONTROLLER_SLOTS)
+                return NULL;
+
+            controller_slot_t* const slot = &table->slots[table->count];
+            slot->key = key;
+            slot->bucket = (uint16_t) bucket;
+            table->buckets[bucket] = (int16_t) table->count++;
+            *added = true;
+            return slot;
+        }
+
+        if (table->slots[index].key == key)
+        {
+            *added = false;
+            return &table->slots[index];
+        }
+
+        bucket = (bucket + 1) & (CONTROLLER_BUCKETS - 1);
+    }
+    return NULL;
+}
@@ -0,0 +1,545 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+/*
+ * Load generator for a running merger. It registers sources that look
+ * like hardware ports, so the merger connects them on its own, floods
+ * them with events and reads them back from the merger's output. It
+ * needs no audio hardware, e.g.
+ *
+ *   $ jackd -d dummy -p 128 &
+ *   $ mod-midi-merger-standalone &
+ *   $ mod-midi-merger-load -n 16 -r 1000 -p random -d 10
+ *
+ * The sources and the reader are two clients, so the graph has no
+ * cycle and an event can make it through the merger in the cycle it
+ * was sent in.
+ */
+
+/* most sources */
+#define MAX_PORTS 256
+
+/* every event carries a sequence number of this many bits */
+#define SEQUENCE_BITS 18
+#define SEQUENCE_COUNT (1u << SEQUENCE_BITS)
+#define SEQUENCE_MASK (SEQUENCE_COUNT - 1)
+
+/* latencies are counted per frame up to this, longer ones in the last
+   bucket */
+#define LATENCY_BUCKETS 16384
+
+/* manufacturer id of SysEx events, for non-commercial use */
+#define SYSEX_ID 0x7d
+
+typedef enum LOAD_PATTERN {
+    // Evenly spaced events.
+    PATTERN_STEADY,
+    // A tenth of a second of events at once, ten times per second.
+    PATTERN_BURST,
+    // Poisson arrivals, random gaps with the same average.
+    PATTERN_RANDOM
+} load_pattern_t;
+
+typedef struct LOAD_SOURCE_T {
+  jack_port_t *port;
+  // When the port was registered, and connected by the merger as seen
+  // by the notification thread.
+  uint64_t registered_ns;
+  uint64_t connected_ns;
+  // Frame the next event is due at, and what is left of the burst.
+  double next_frame;
+  uint32_t burst_left;
+} load_source_t;
+
+typedef struct LOAD_T {
+  jack_client_t *sender;
+  jack_client_t *reader;
+  jack_port_t *in;
+
+  int num_ports;
+  double rate;
+  load_pattern_t pattern;
+  size_t event_size;
+  jack_nframes_t sample_rate;
+
+  load_source_t sources[MAX_PORTS];
+  // Sources the sender's process callback knows about.
+  int num_registered;
+  bool running;
+  bool started;
+  bool server_gone;
+
+  // State of the sender's process callback.
+  uint64_t frames;
+  uint32_t sequence;
+  uint64_t random_state;
+  uint64_t sent;
+  uint64_t send_failed;
+
+  // Frame each sequence number was sent at, and whether it is still
+  // expected. The sender writes, the reader takes them.
+  jack_nframes_t sent_frame[SEQUENCE_COUNT];
+  uint8_t pending[SEQUENCE_COUNT];
+
+  // State of the reader's process callback.
+  uint64_t received;
+  uint64_t unexpected;
+  uint64_t foreign;
+  uint64_t latency[LATENCY_BUCKETS];
+} load_t;
+
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+
+static void sleep_ms(unsigned ms) {
+  const struct timespec duration = { ms / 1000, (long) (ms % 1000) * 1000000 };
+  nanosleep(&duration, NULL);
+}
+
+
+/**
+ * Uniform in [0, 1), xorshift64*.
+ */
+static double next_random(load_t *load) {
+  uint64_t x = load->random_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  load->random_state = x;
+  return (double) ((x * 0x2545f4914f6cdd1dull) >> 11) / 9007199254740992.0;
+}
+
+
+/**
+ * When the event after this one is due.
+ */
+static void schedule_next(load_t *load, load_source_t *source) {
+  const double interval = (double) load->sample_rate / load->rate;
+
+  switch (load->pattern) {
+  case PATTERN_STEADY:
+    source->next_frame += interval;
+    break;
+  case PATTERN_BURST:
+    if (--source->burst_left == 0) {
+      source->next_frame += (double) load->sample_rate / 10;
+      source->burst_left = load->rate >= 10 ? (uint32_t) (load->rate / 10) : 1;
+    }
+    break;
+  case PATTERN_RANDOM:
+    source->next_frame -= log(1.0 - next_random(load)) * interval;
+    break;
+  }
+}
+
+
+/**
+ * Write one event with the next sequence number. Three byte events are
+ * Poly Pressure with the number in the channel and both data bytes,
+ * bigger ones SysEx.
+ */
+static void send_event(load_t *load, void *buffer, jack_nframes_t offset, jack_nframes_t frame) {
+  const uint32_t sequence = load->sequence++ & SEQUENCE_MASK;
+  jack_midi_data_t data[1024];
+  const size_t size = load->event_size;
+
+  if (size == 3) {
+    data[0] = (jack_midi_data_t) (0xa0 | ((sequence >> 14) & 0x0f));
+    data[1] = (jack_midi_data_t) ((sequence >> 7) & 0x7f);
+    data[2] = (jack_midi_data_t) (sequence & 0x7f);
+  } else {
+    memset(data, 0, size);
+    data[0] = 0xf0;
+    data[1] = SYSEX_ID;
+    data[2] = (jack_midi_data_t) ((sequence >> 14) & 0x7f);
+    data[3] = (jack_midi_data_t) ((sequence >> 7) & 0x7f);
+    data[4] = (jack_midi_data_t) (sequence & 0x7f);
+    data[size - 1] = 0xf7;
+  }
+
+  load->sent_frame[sequence] = frame;
+  __atomic_store_n(&load->pending[sequence], 1, __ATOMIC_RELEASE);
+  if (jack_midi_event_write(buffer, offset, data, size) == 0) {
+    ++load->sent;
+  } else {
+    __atomic_store_n(&load->pending[sequence], 0, __ATOMIC_RELAXED);
+    ++load->send_failed;
+  }
+}
+
+
+static int send_process(jack_nframes_t nframes, void *arg) {
+  load_t *const load = (load_t *const) arg;
+  const jack_nframes_t cycle_frame = jack_last_frame_time(load->sender);
+  const int num_ports = __atomic_load_n(&load->num_registered, __ATOMIC_ACQUIRE);
+  const bool running = __atomic_load_n(&load->running, __ATOMIC_ACQUIRE);
+
+  if (running && !load->started) {
+    // Spread the sources over the first interval.
+    const double interval = (double) load->sample_rate / load->rate;
+    for (int i = 0; i < num_ports; ++i) {
+      load->sources[i].next_frame = (double) load->frames + interval * i / num_ports;
+      load->sources[i].burst_left = load->rate >= 10 ? (uint32_t) (load->rate / 10) : 1;
+    }
+    load->started = true;
+  }
+
+  const double end = (double) (load->frames + nframes);
+  for (int i = 0; i < num_ports; ++i) {
+    load_source_t *const source = &load->sources[i];
+    void *const buffer = jack_port_get_buffer(source->port, nframes);
+    jack_midi_clear_buffer(buffer);
+    if (!running) {
+      continue;
+    }
+    while (source->next_frame < end) {
+      const jack_nframes_t offset = source->next_frame > (double) load->frames
+                                  ? (jack_nframes_t) (source->next_frame - (double) load->frames) : 0;
+      send_event(load, buffer, offset, cycle_frame + offset);
+      schedule_next(load, source);
+    }
+  }
+
+  load->frames += nframes;
+  return 0;
+}
+
+
+/**
+ * The sequence number of an event sent by us, or -1.
+ */
+static int32_t decode_event(const load_t *load, const jack_midi_event_t *event) {
+  const jack_midi_data_t *const data = event->buffer;
+
+  if (load->event_size == 3) {
+    if (event->size != 3 || (data[0] & 0xf0) != 0xa0) {
+      return -1;
+    }
+    return (int32_t) (((uint32_t) (data[0] & 0x0f) << 14) | ((uint32_t) data[1] << 7) | data[2]);
+  }
+  if (event->size < 6 || data[0] != 0xf0 || data[1] != SYSEX_ID) {
+    return -1;
+  }
+  return (int32_t) ((((uint32_t) data[2] << 14) | ((uint32_t) data[3] << 7) | data[4])
+                    & SEQUENCE_MASK);
+}
+
+
+static int read_process(jack_nframes_t nframes, void *arg) {
+  load_t *const load = (load_t *const) arg;
+  const jack_nframes_t cycle_frame = jack_last_frame_time(load->reader);
+  void *const buffer = jack_port_get_buffer(load->in, nframes);
+  const uint32_t count = jack_midi_get_event_count(buffer);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    jack_midi_event_t event;
+    if (jack_midi_event_get(&event, buffer, i) != 0) {
+      continue;
+    }
+    const int32_t sequence = decode_event(load, &event);
+    if (sequence < 0) {
+      ++load->foreign;
+      continue;
+    }
+    if (__atomic_exchange_n(&load->pending[sequence], 0, __ATOMIC_ACQUIRE) == 0) {
+      ++load->unexpected;
+      continue;
+    }
+
+    const jack_nframes_t latency = cycle_frame + event.time - load->sent_frame[sequence];
+    ++load->latency[latency < LATENCY_BUCKETS ? latency : LATENCY_BUCKETS - 1];
+    ++load->received;
+  }
+  return 0;
+}
+
+
+static void port_connected(jack_port_id_t a, jack_port_id_t b, int connect, void *arg) {
+  load_t *const load = (load_t *const) arg;
+  if (!connect) {
+    return;
+  }
+
+  // The merger may connect a source before its registration returned,
+  // so it is found by name.
+  jack_port_t *const port = jack_port_by_id(load->sender, a);
+  int index;
+  if (port == NULL || !jack_port_is_mine(load->sender, port)
+      || sscanf(jack_port_short_name(port), "source_%d", &index) != 1
+      || index < 1 || index > load->num_ports) {
+    return;
+  }
+
+  load_source_t *const source = &load->sources[index - 1];
+  uint64_t expected = 0;
+  __atomic_compare_exchange_n(&source->connected_ns, &expected, now_ns(), false,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+
+static void server_shutdown(void *arg) {
+  load_t *const load = (load_t *const) arg;
+  __atomic_store_n(&load->server_gone, true, __ATOMIC_RELAXED);
+}
+
+
+static jack_client_t *open_client(const char *name) {
+  jack_status_t status;
+  jack_client_t *const client = jack_client_open(name, JackNoStartServer, &status);
+  if (client == NULL) {
+    fprintf(stderr, "Opening client failed. Status is %d.\n", status);
+    if (status & JackServerFailed) {
+      fprintf(stderr, "Unable to connect to Jack server.\n");
+    }
+  }
+  return client;
+}
+
+
+/**
+ * Register the sources and wait until the merger connected them.
+ * Returns the number of connected sources.
+ */
+static int add_sources(load_t *load, unsigned timeout_ms) {
+  for (int i = 0; i < load->num_ports; ++i) {
+    load_source_t *const source = &load->sources[i];
+    char name[32];
+    snprintf(name, sizeof(name), "source_%d", i + 1);
+
+    source->registered_ns = now_ns();
+    source->port = jack_port_register(load->sender, name, JACK_DEFAULT_MIDI_TYPE,
+                                      JackPortIsOutput | JackPortIsPhysical | JackPortIsTerminal, 0);
+    if (source->port == NULL) {
+      fprintf(stderr, "Can't register jack port\n");
+      break;
+    }
+    __atomic_store_n(&load->num_registered, i + 1, __ATOMIC_RELEASE);
+  }
+
+  const int num_ports = load->num_registered;
+  int connected = 0;
+  const uint64_t deadline = now_ns() + (uint64_t) timeout_ms * 1000000;
+  while (now_ns() < deadline && !__atomic_load_n(&load->server_gone, __ATOMIC_RELAXED)) {
+    connected = 0;
+    for (int i = 0; i < num_ports; ++i) {
+      if (__atomic_load_n(&load->sources[i].connected_ns, __ATOMIC_RELAXED) != 0) {
+        ++connected;
+      }
+    }
+    if (connected == num_ports) {
+      break;
+    }
+    sleep_ms(10);
+  }
+  return connected;
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *) a;
+  const uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+
+static void report_connections(const load_t *load) {
+  uint64_t times[MAX_PORTS];
+  int count = 0;
+
+  for (int i = 0; i < load->num_registered; ++i) {
+    const load_source_t *const source = &load->sources[i];
+    if (source->connected_ns != 0) {
+      times[count++] = source->connected_ns - source->registered_ns;
+    }
+  }
+  qsort(times, (size_t) count, sizeof(uint64_t), compare_u64);
+
+  printf("ports %d\n", load->num_registered);
+  printf("ports_connected %d\n", count);
+  if (count > 0) {
+    printf("connect_p50_ms %.3f\n", (double) times[count / 2] / 1e6);
+    printf("connect_max_ms %.3f\n", (double) times[count - 1] / 1e6);
+  }
+}
+
+
+/**
+ * Latency at the percentile `p` of the received events, in frames.
+ */
+static unsigned latency_percentile(const load_t *load, double p) {
+  const uint64_t target = (uint64_t) ceil(p / 100 * (double) load->received);
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+    sum += load->latency[i];
+    if (sum >= target && sum > 0) {
+      return i;
+    }
+  }
+  return LATENCY_BUCKETS - 1;
+}
+
+
+static void report_events(const load_t *load, double seconds) {
+  const uint64_t lost = load->sent - load->received;
+
+  printf("sent %" PRIu64 "\n", load->sent);
+  printf("send_failed %" PRIu64 "\n", load->send_failed);
+  printf("received %" PRIu64 "\n", load->received);
+  printf("lost %" PRIu64 "\n", lost);
+  printf("lost_percent %.3f\n", load->sent > 0 ? 100.0 * (double) lost / (double) load->sent : 0.0);
+  printf("unexpected %" PRIu64 "\n", load->unexpected);
+  printf("foreign %" PRIu64 "\n", load->foreign);
+  printf("events_per_second %.1f\n", (double) load->received / seconds);
+
+  if (load->received == 0) {
+    return;
+  }
+  static const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+  static const char *const names[] = { "p50", "p90", "p99", "p999", "max" };
+  for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+    const unsigned frames = latency_percentile(load, percentiles[i]);
+    printf("latency_%s_frames %u%s\n", names[i], frames,
+           frames == LATENCY_BUCKETS - 1 ? "+" : "");
+    printf("latency_%s_us %.1f\n", names[i], 1e6 * frames / load->sample_rate);
+  }
+}
+
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-n ports] [-r events/s] [-p steady|burst|random] [-s bytes]\n"
+          "          [-d seconds] [-w connect timeout ms] [-t merger output]\n",
+          name);
+}
+
+
+int main(int argc, char **argv) {
+  load_t *const load = calloc(1, sizeof(load_t));
+  if (load == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  load->num_ports = 4;
+  load->rate = 100;
+  load->pattern = PATTERN_STEADY;
+  load->event_size = 3;
+  load->random_state = 0x9e3779b97f4a7c15ull;
+  double seconds = 10;
+  unsigned timeout_ms = 5000;
+  const char *target = "mod-midi-merger:out";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:p:s:d:w:t:")) != -1) {
+    switch (opt) {
+    case 'n':
+      load->num_ports = atoi(optarg);
+      break;
+    case 'r':
+      load->rate = atof(optarg);
+      break;
+    case 'p':
+      if (strcmp(optarg, "steady") == 0) {
+        load->pattern = PATTERN_STEADY;
+      } else if (strcmp(optarg, "burst") == 0) {
+        load->pattern = PATTERN_BURST;
+      } else if (strcmp(optarg, "random") == 0) {
+        load->pattern = PATTERN_RANDOM;
+      } else {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 's':
+      load->event_size = (size_t) atoi(optarg);
+      break;
+    case 'd':
+      seconds = atof(optarg);
+      break;
+    case 'w':
+      timeout_ms = (unsigned) atoi(optarg);
+      break;
+    case 't':
+      target = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  // SysEx needs room for the sequence number.
+  if (load->num_ports < 1 || load->num_ports > MAX_PORTS || load->rate <= 0 || seconds <= 0
+      || (load->event_size != 3 && (load->event_size < 6 || load->event_size > 1024))) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  load->sender = open_client("mod-midi-merger-load");
+  load->reader = load->sender ? open_client("mod-midi-merger-load-in") : NULL;
+  if (load->reader == NULL) {
+    return EXIT_FAILURE;
+  }
+  load->sample_rate = jack_get_sample_rate(load->sender);
+
+  load->in = jack_port_register(load->reader, "in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+  if (load->in == NULL) {
+    fprintf(stderr, "Can't register jack port\n");
+    return EXIT_FAILURE;
+  }
+  jack_set_process_callback(load->reader, read_process, load);
+  jack_set_process_callback(load->sender, send_process, load);
+  jack_set_port_connect_callback(load->sender, port_connected, load);
+  jack_on_shutdown(load->sender, server_shutdown, load);
+  jack_on_shutdown(load->reader, server_shutdown, load);
+
+  if (jack_activate(load->reader) != 0 || jack_activate(load->sender) != 0) {
+    fprintf(stderr, "can't activate jack client\n");
+    return EXIT_FAILURE;
+  }
+  if (jack_connect(load->reader, target, jack_port_name(load->in)) != 0) {
+    fprintf(stderr, "Can't connect %s.\n", target);
+    return EXIT_FAILURE;
+  }
+
+  // The sources register after the activation, like hardware showing
+  // up, so the merger connects them.
+  add_sources(load, timeout_ms);
+
+  __atomic_store_n(&load->running, true, __ATOMIC_RELEASE);
+  const uint64_t start = now_ns();
+  while (now_ns() - start < (uint64_t) (seconds * 1e9)
+         && !__atomic_load_n(&load->server_gone, __ATOMIC_RELAXED)) {
+    sleep_ms(100);
+  }
+  const double elapsed = (double) (now_ns() - start) / 1e9;
+  __atomic_store_n(&load->running, false, __ATOMIC_RELEASE);
+
+  // Let the last events come through.
+  sleep_ms(500);
+  if (!__atomic_load_n(&load->server_gone, __ATOMIC_RELAXED)) {
+    jack_deactivate(load->sender);
+    jack_deactivate(load->reader);
+  }
+
+  report_connections(load);
+  report_events(load, elapsed);
+
+  jack_client_close(load->sender);
+  jack_client_close(load->reader);
+  free(load);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+#include "merger-capture.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t padding[8];
+
+
+static size_t ring_size(size_t bytes) {
+  size_t size = 4096;
+  while (size < bytes) {
+    size *= 2;
+  }
+  return size;
+}
+
+
+int merger_capture_open(merger_capture_t *capture, const char *path, size_t bytes,
+                        const capture_header_t *header, rt_arena_t *arena) {
+  memset(capture, 0, sizeof(merger_capture_t));
+
+  const size_t size = ring_size(bytes);
+  uint8_t *const ring = arena != NULL ? rt_arena_alloc(arena, size) : calloc(size, 1);
+  if (ring == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  capture->in_arena = arena != NULL;
+
+  capture->file = fopen(path, "wb");
+  if (capture->file == NULL
+      || fwrite(header, sizeof(capture_header_t), 1, capture->file) != 1
+      || fflush(capture->file) != 0) {
+    fprintf(stderr, "Can't write capture %s: %s\n", path, strerror(errno));
+    if (capture->file != NULL) {
+      fclose(capture->file);
+    }
+    if (!capture->in_arena) {
+      free(ring);
+    }
+    memset(capture, 0, sizeof(merger_capture_t));
+    return -1;
+  }
+
+  capture->ring = ring;
+  capture->size = size;
+  return 0;
+}
+
+
+size_t merger_capture_memory(size_t bytes) {
+  return bytes > 0 ? ring_size(bytes) + RT_ARENA_ALIGN : 0;
+}
+
+
+void merger_capture_close(merger_capture_t *capture) {
+  if (capture->file != NULL) {
+    merger_capture_flush(capture);
+    fclose(capture->file);
+  }
+  if (!capture->in_arena) {
+    free(capture->ring);
+  }
+  memset(capture, 0, sizeof(merger_capture_t));
+}
+
+
+/**
+ * Copy to the ring at `position`, wrapping around its end.
+ */
+static void ring_put(merger_capture_t *capture, uint64_t position,
+                     const void *data, size_t size) {
+  const size_t offset = (size_t) position & (capture->size - 1);
+  const size_t first = size < capture->size - offset ? size : capture->size - offset;
+  memcpy(capture->ring + offset, data, first);
+  memcpy(capture->ring, (const uint8_t *) data + first, size - first);
+}
+
+
+static uint64_t put_record(merger_capture_t *capture, uint64_t position, uint64_t frame,
+                           uint8_t source, const void *data, uint32_t size) {
+  const capture_record_t record = { .frame = frame, .size = size, .source = source };
+  ring_put(capture, position, &record, sizeof(record));
+  ring_put(capture, position + sizeof(record), data, size);
+  const size_t padded = capture_record_size(size) - sizeof(record);
+  ring_put(capture, position + sizeof(record) + size, padding, padded - size);
+  return position + capture_record_size(size);
+}
+
+
+bool merger_capture_event(merger_capture_t *capture, uint64_t frame, uint8_t source,
+                          const uint8_t *data, size_t size) {
+  const size_t needed = capture_record_size((uint32_t) size)
+                      + (capture->cycle_pending ? capture_record_size(sizeof(uint32_t)) : 0);
+  const uint64_t tail = __atomic_load_n(&capture->tail, __ATOMIC_ACQUIRE);
+  uint64_t head = capture->head;
+  if (needed > capture->size - (size_t) (head - tail)) {
+    return false;
+  }
+
+  if (capture->cycle_pending) {
+    head = put_record(capture, head, capture->cycle_frame, CAPTURE_CYCLE,
+                      &capture->cycle_length, sizeof(uint32_t));
+    capture->cycle_pending = false;
+  }
+  head = put_record(capture, head, frame, source, data, (uint32_t) size);
+  __atomic_store_n(&capture->head, head, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+int merger_capture_flush(merger_capture_t *capture) {
+  const uint64_t head = __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = capture->tail;
+  int result = 0;
+
+  while (tail != head) {
+    const size_t offset = (size_t) tail & (capture->size - 1);
+    size_t chunk = (size_t) (head - tail);
+    if (chunk > capture->size - offset) {
+      chunk = capture->size - offset;
+    }
+    if (!capture->failed && fwrite(capture->ring + offset, 1, chunk, capture->file) != chunk) {
+      fprintf(stderr, "Can't write capture: %s, recording stopped.\n", strerror(errno));
+      capture->failed = true;
+      result = -1;
+    }
+    tail += chunk;
+  }
+  if (!capture->failed && fflush(capture->file) != 0) {
+    fprintf(stderr, "Can't write capture: %s, recording stopped.\n", strerror(errno));
+    capture->failed = true;
+    result = -1;
+  }
+
+  __atomic_store_n(&capture->tail, tail, __ATOMIC_RELEASE);
+  return result;
+}
@@ -0,0 +1,137 @@
+#ifndef MERGER_CAPTURE_H
+#define MERGER_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "rt-arena.h"
+
+/* first bytes and layout version of a capture file */
+#define CAPTURE_MAGIC "MIDICAP"
+#define CAPTURE_VERSION 1
+
+/* `source` of the events written to `out` */
+#define CAPTURE_OUT 0xfe
+
+/* `source` of a cycle record, its data is the cycle length in frames
+   as `uint32_t` */
+#define CAPTURE_CYCLE 0xff
+
+/**
+ * A capture file is this header followed by records, each one a
+ * `capture_record_t` and its data padded to 8 bytes, so the file can
+ * be mapped and walked in place. Every cycle that has events starts
+ * with a cycle record. Values are in host byte order.
+ */
+typedef struct CAPTURE_HEADER_T {
+  char magic[8];
+  uint32_t version;
+  uint32_t sample_rate;
+  // `merger_port_format_t` of the events.
+  uint32_t format;
+  // Size of the MIDI port buffers.
+  uint32_t buffer_size;
+  // Wall clock time the capture was opened, about frame 0.
+  uint64_t started_ns;
+} capture_header_t;
+
+typedef struct CAPTURE_RECORD_T {
+  // Frame of the event, counted from the client start.
+  uint64_t frame;
+  uint32_t size;
+  // The input, 0 for `in` and n for `in_<n>`, `CAPTURE_OUT` or
+  // `CAPTURE_CYCLE`.
+  uint8_t source;
+  uint8_t reserved[3];
+} capture_record_t;
+
+/**
+ * The recorder. The process callback writes records into a ring that
+ * the supervisor appends to the file. The ring holds the bytes just as
+ * they go into the file, so flushing is a plain copy and the realtime
+ * thread never waits for the disk. Records that don't fit are lost.
+ */
+typedef struct MERGER_CAPTURE_T {
+  uint8_t *ring;
+  size_t size;
+  // Bytes written and flushed since the start. Only the process
+  // callback moves `head` and only the supervisor `tail`.
+  uint64_t head;
+  uint64_t tail;
+
+  // The cycle record that goes before the first event of a cycle.
+  uint64_t cycle_frame;
+  uint32_t cycle_length;
+  bool cycle_pending;
+
+  FILE *file;
+  bool failed;
+  // The ring comes from an arena and is not freed.
+  bool in_arena;
+} merger_capture_t;
+
+static inline size_t capture_record_size(uint32_t size) {
+  return sizeof(capture_record_t) + (((size_t) size + 7) & ~(size_t) 7);
+}
+
+static inline const uint8_t *capture_record_data(const capture_record_t *record) {
+  return (const uint8_t *) (record + 1);
+}
+
+/**
+ * Create `path` and a ring of at least `bytes`, from `arena` unless it
+ * is NULL. Returns 0 on success.
+ */
+int merger_capture_open(merger_capture_t *capture, const char *path, size_t bytes,
+                        const capture_header_t *header, rt_arena_t *arena);
+
+/**
+ * The memory `merger_capture_open()` allocates for `bytes`.
+ */
+size_t merger_capture_memory(size_t bytes);
+
+/**
+ * Flush what is left and close the file. A capture that was never
+ * opened is fine too.
+ */
+void merger_capture_close(merger_capture_t *capture);
+
+static inline bool merger_capture_active(const merger_capture_t *capture) {
+  return capture->ring != NULL;
+}
+
+/**
+ * Start a cycle. Its record is only written with the first event.
+ */
+static inline void merger_capture_cycle(merger_capture_t *capture, uint64_t frame,
+                                        uint32_t length) {
+  capture->cycle_frame = frame;
+  capture->cycle_length = length;
+  capture->cycle_pending = true;
+}
+
+/**
+ * Record an event. It is safe to call from the realtime context.
+ * Returns false if the ring is full.
+ */
+bool merger_capture_event(merger_capture_t *capture, uint64_t frame, uint8_t source,
+                          const uint8_t *data, size_t size);
+
+/**
+ * Bytes in the ring that are not written to the file yet.
+ */
+static inline size_t merger_capture_pending(const merger_capture_t *capture) {
+  return (size_t) (__atomic_load_n(&capture->head, __ATOMIC_ACQUIRE)
+                   - __atomic_load_n(&capture->tail, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Append the records in the ring to the file, in the non-realtime
+ * context. After a write error records are discarded. Returns -1 on
+ * the first error.
+ */
+int merger_capture_flush(merger_capture_t *capture);
+
+#endif
@@ -0,0 +1,655 @@
+#include "merger-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* longest token (`key=value`) accepted by the parser */
+#define MAX_TOKEN_SIZE 256
+
+typedef int (*option_handler_t)(merger_config_t *cfg, const char *value);
+
+typedef struct OPTION_T {
+  const char *key;
+  option_handler_t handler;
+} option_t;
+
+
+/**
+ * Parse a decimal integer, the whole string has to be consumed.
+ */
+static int parse_int(const char *value, int *result) {
+  char *end = NULL;
+  long number = strtol(value, &end, 10);
+
+  if (end == value || *end != '\0') {
+    return -1;
+  }
+  *result = (int) number;
+  return 0;
+}
+
+
+/**
+ * `mode=merger|broadcaster|both`
+ */
+static int parse_mode(merger_config_t *cfg, const char *value) {
+  if (strcmp(value, "merger") == 0) {
+    cfg->mode = CLIENT_MODE_MERGER;
+  } else if (strcmp(value, "broadcaster") == 0) {
+    cfg->mode = CLIENT_MODE_BROADCASTER;
+  } else if (strcmp(value, "both") == 0) {
+    cfg->mode = CLIENT_MODE_BOTH;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `format=midi1|ump`
+ */
+static int parse_format(merger_config_t *cfg, const char *value) {
+  if (strcmp(value, "midi1") == 0) {
+    cfg->format = FORMAT_MIDI1;
+  } else if (strcmp(value, "ump") == 0) {
+    cfg->format = FORMAT_UMP;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `inputs=shared|per-source`
+ */
+static int parse_inputs(merger_config_t *cfg, const char *value) {
+  if (strcmp(value, "shared") == 0) {
+    cfg->per_source = false;
+  } else if (strcmp(value, "per-source") == 0) {
+    cfg->per_source = true;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `priority=<pattern>:<number>`, the pattern may contain `:` itself.
+ */
+static int parse_priority(merger_config_t *cfg, const char *value) {
+  const char *separator = strrchr(value, ':');
+  if (separator == NULL || separator == value) {
+    return -1;
+  }
+
+  size_t pattern_length = (size_t) (separator - value);
+  if (pattern_length >= MERGER_PATTERN_SIZE
+      || cfg->num_priority_rules >= MERGER_MAX_PRIORITY_RULES) {
+    return -1;
+  }
+
+  merger_priority_rule_t *const rule = &cfg->priority_rules[cfg->num_priority_rules];
+  if (parse_int(separator + 1, &rule->priority) != 0) {
+    return -1;
+  }
+  memcpy(rule->pattern, value, pattern_length);
+  rule->pattern[pattern_length] = '\0';
+  ++cfg->num_priority_rules;
+  return 0;
+}
+
+
+/**
+ * Parse `on` or `off`.
+ */
+static int parse_bool(const char *value, bool *result) {
+  if (strcmp(value, "on") == 0) {
+    *result = true;
+  } else if (strcmp(value, "off") == 0) {
+    *result = false;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `coalesce=on|off`
+ */
+static int parse_coalesce(merger_config_t *cfg, const char *value) {
+  return parse_bool(value, &cfg->coalesce);
+}
+
+
+/**
+ * `overflow=drop|protect`
+ */
+static int parse_overflow(merger_config_t *cfg, const char *value) {
+  if (strcmp(value, "drop") == 0) {
+    cfg->overflow = OVERFLOW_DROP;
+  } else if (strcmp(value, "protect") == 0) {
+    cfg->overflow = OVERFLOW_PROTECT;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `clock=all|first|priority`
+ */
+static int parse_clock(merger_config_t *cfg, const char *value) {
+  if (strcmp(value, "all") == 0) {
+    cfg->clock_election = CLOCK_ALL;
+  } else if (strcmp(value, "first") == 0) {
+    cfg->clock_election = CLOCK_FIRST;
+  } else if (strcmp(value, "priority") == 0) {
+    cfg->clock_election = CLOCK_PRIORITY;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `clock-timeout=<ticks>`
+ */
+static int parse_clock_timeout(merger_config_t *cfg, const char *value) {
+  if (parse_int(value, &cfg->clock_timeout) != 0 || cfg->clock_timeout < 1) {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `active-sensing=<milliseconds>`
+ */
+static int parse_active_sensing(merger_config_t *cfg, const char *value) {
+  if (parse_int(value, &cfg->active_sensing_ms) != 0 || cfg->active_sensing_ms < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `headroom=<bytes>`
+ */
+static int parse_headroom(merger_config_t *cfg, const char *value) {
+  if (parse_int(value, &cfg->headroom) != 0 || cfg->headroom < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `spill=<bytes>`
+ */
+static int parse_spill(merger_config_t *cfg, const char *value) {
+  if (parse_int(value, &cfg->spill) != 0 || cfg->spill < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `spill-age=<milliseconds>`
+ */
+static int parse_spill_age(merger_config_t *cfg, const char *value) {
+  if (parse_int(value, &cfg->spill_age_ms) != 0 || cfg->spill_age_ms < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `sysex-pool=<bytes>`
+ */
+static int parse_sysex_pool(merger_config_t *cfg, const char *value) {
+  if (parse_int(value, &cfg->sysex_pool) != 0 || cfg->sysex_pool < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `sysex-budget=<bytes>`
+ */
+static int parse_sysex_budget(merger_config_t *cfg, const char *value) {
+  if (parse_int(value, &cfg->sysex_budget) != 0 || cfg->sysex_budget < 1) {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `filter=<types>[@<channels>]`
+ */
+static int parse_filter(merger_config_t *cfg, const char *value) {
+  return midi_filter_add_drop(&cfg->filter, value);
+}
+
+
+/**
+ * `rate=<types>:<events per second>`
+ * Only controllers, aftertouch, pitch bend, program changes and SysEx
+ * can be limited, for all channels.
+ */
+static int parse_rate(merger_config_t *cfg, const char *value) {
+  const char *separator = strrchr(value, ':');
+  if (separator == NULL || separator == value || strchr(value, '@') != NULL) {
+    return -1;
+  }
+
+  int rate;
+  if (parse_int(separator + 1, &rate) != 0 || rate < 0) {
+    return -1;
+  }
+
+  char types[128];
+  const size_t length = (size_t) (separator - value);
+  if (length >= sizeof(types)) {
+    return -1;
+  }
+  memcpy(types, value, length);
+  types[length] = '\0';
+
+  bool statuses[256] = { false };
+  if (midi_filter_parse_types(types, statuses) != 0) {
+    return -1;
+  }
+
+  bool classes[MSG_CLASS_COUNT] = { false };
+  for (int status = 0; status < 256; ++status) {
+    if (statuses[status]) {
+      const uint8_t message[3] = { (uint8_t) status, 0, 1 };
+      const midi_message_class_t cls = midi_classify(message, sizeof(message));
+      if (!midi_is_continuous(cls) && cls != MSG_PROGRAM_CHANGE && cls != MSG_SYSEX) {
+        return -1;
+      }
+      classes[cls] = true;
+    }
+  }
+
+  for (int cls = 0; cls < MSG_CLASS_COUNT; ++cls) {
+    if (classes[cls]) {
+      cfg->rate_limits[cls] = (uint32_t) rate;
+      cfg->rate_limited = cfg->rate_limited || rate > 0;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * `route=<pattern>:<types>[@<channels>]`
+ * Rules with the same pattern share an output.
+ */
+static int parse_route(merger_config_t *cfg, const char *value) {
+  const char *separator = strrchr(value, ':');
+  if (separator == NULL || separator == value) {
+    return -1;
+  }
+
+  size_t pattern_length = (size_t) (separator - value);
+  if (pattern_length >= MERGER_PATTERN_SIZE) {
+    return -1;
+  }
+  char pattern[MERGER_PATTERN_SIZE];
+  memcpy(pattern, value, pattern_length);
+  pattern[pattern_length] = '\0';
+
+  bool statuses[256] = { false };
+  if (midi_filter_parse_types(separator + 1, statuses) != 0) {
+    return -1;
+  }
+
+  int route = 0;
+  while (route < cfg->num_routes && strcmp(cfg->route_patterns[route], pattern) != 0) {
+    ++route;
+  }
+  if (route == MERGER_MAX_ROUTES) {
+    return -1;
+  }
+  if (route == cfg->num_routes) {
+    strcpy(cfg->route_patterns[route], pattern);
+    ++cfg->num_routes;
+  }
+
+  for (int status = 0; status < 256; ++status) {
+    if (statuses[status]) {
+      cfg->route_masks[status] |= (uint16_t) (1 << route);
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * `remap=<channel>:<channel>`
+ */
+static int parse_remap(merger_config_t *cfg, const char *value) {
+  return midi_filter_add_remap(&cfg->filter, value);
+}
+
+
+/**
+ * `transpose=<semitones>[@<channels>]`
+ */
+static int parse_transpose(merger_config_t *cfg, const char *value) {
+  return midi_filter_add_transpose(&cfg->filter, value);
+}
+
+
+/**
+ * `memory=default|locked`
+ */
+static int parse_memory(merger_config_t *cfg, const char *value) {
+  if (strcmp(value, "default") == 0) {
+    cfg->locked_memory = false;
+  } else if (strcmp(value, "locked") == 0) {
+    cfg->locked_memory = true;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * `supervisor=inherit|other|batch|idle|fifo:<priority>|rr:<priority>`
+ */
+static int parse_supervisor(merger_config_t *cfg, const char *value) {
+  static const struct {
+    const char *name;
+    merger_supervisor_policy_t policy;
+  } policies[] = {
+    { "inherit", SUPERVISOR_INHERIT },
+    { "other",   SUPERVISOR_OTHER },
+    { "batch",   SUPERVISOR_BATCH },
+    { "idle",    SUPERVISOR_IDLE },
+    { "fifo",    SUPERVISOR_FIFO },
+    { "rr",      SUPERVISOR_RR },
+  };
+
+  const char *const separator = strchr(value, ':');
+  const size_t length = separator ? (size_t) (separator - value) : strlen(value);
+
+  for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+    if (strlen(policies[i].name) != length || strncmp(value, policies[i].name, length) != 0) {
+      continue;
+    }
+    const merger_supervisor_policy_t policy = policies[i].policy;
+    const bool realtime = policy == SUPERVISOR_FIFO || policy == SUPERVISOR_RR;
+
+    // Realtime policies need a priority, the others have none.
+    int priority = 0;
+    if (realtime != (separator != NULL)
+        || (separator && (parse_int(separator + 1, &priority) != 0
+                          || priority < 1 || priority > 99))) {
+      return -1;
+    }
+    cfg->supervisor_policy = policy;
+    cfg->supervisor_priority = priority;
+    return 0;
+  }
+  return -1;
+}
+
+
+/**
+ * `supervisor-cpus=<list>`, e.g. `0,2-3`
+ */
+static int parse_supervisor_cpus(merger_config_t *cfg, const char *value) {
+  uint64_t cpus = 0;
+
+  while (*value != '\0') {
+    char *end;
+    const long first = strtol(value, &end, 10);
+    long last = first;
+    if (end == value) {
+      return -1;
+    }
+    if (*end == '-') {
+      value = end + 1;
+      last = strtol(value, &end, 10);
+      if (end == value) {
+        return -1;
+      }
+    }
+    if (first < 0 || last > 63 || first > last) {
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus |= 1ull << cpu;
+    }
+
+    if (*end == ',') {
+      ++end;
+    } else if (*end != '\0') {
+      return -1;
+    }
+    value = end;
+  }
+
+  if (cpus == 0) {
+    return -1;
+  }
+  cfg->supervisor_cpus = cpus;
+  return 0;
+}
+
+
+/**
+ * `stats=off|/<name>`
+ */
+static int parse_stats(merger_config_t *cfg, const char *value) {
+  if (strcmp(value, "off") == 0) {
+    cfg->stats = false;
+    return 0;
+  }
+
+  // POSIX shared memory names are `/` and a name without slashes.
+  if (value[0] != '/' || strchr(value + 1, '/') != NULL
+      || strlen(value) >= MERGER_STATS_NAME_SIZE) {
+    return -1;
+  }
+  cfg->stats = true;
+  strcpy(cfg->stats_name, value);
+  return 0;
+}
+
+
+/**
+ * `control=<path>`
+ */
+static int parse_control(merger_config_t *cfg, const char *value) {
+  if (value[0] == '\0' || strlen(value) >= MERGER_CONTROL_PATH_SIZE) {
+    return -1;
+  }
+  strcpy(cfg->control_path, value);
+  return 0;
+}
+
+
+/**
+ * `capture=<path>`
+ */
+static int parse_capture(merger_config_t *cfg, const char *value) {
+  if (value[0] == '\0' || strlen(value) >= MERGER_CAPTURE_PATH_SIZE) {
+    return -1;
+  }
+  strcpy(cfg->capture_path, value);
+  return 0;
+}
+
+
+/**
+ * `capture-size=<bytes>`
+ */
+static int parse_capture_size(merger_config_t *cfg, const char *value) {
+  if (parse_int(value, &cfg->capture_size) != 0 || cfg->capture_size < 4096) {
+    return -1;
+  }
+  return 0;
+}
+
+
+static const option_t options_table[] = {
+  { "mode",     parse_mode },
+  { "format",   parse_format },
+  { "inputs",   parse_inputs },
+  { "priority", parse_priority },
+  { "stats",    parse_stats },
+  { "coalesce", parse_coalesce },
+  { "overflow", parse_overflow },
+  { "headroom", parse_headroom },
+  { "spill",    parse_spill },
+  { "spill-age", parse_spill_age },
+  { "sysex-pool", parse_sysex_pool },
+  { "sysex-budget", parse_sysex_budget },
+  { "filter",   parse_filter },
+  { "route",    parse_route },
+  { "rate",     parse_rate },
+  { "clock",    parse_clock },
+  { "clock-timeout", parse_clock_timeout },
+  { "active-sensing", parse_active_sensing },
+  { "remap",    parse_remap },
+  { "transpose", parse_transpose },
+  { "control",  parse_control },
+  { "capture",  parse_capture },
+  { "capture-size", parse_capture_size },
+  { "memory",   parse_memory },
+  { "supervisor", parse_supervisor },
+  { "supervisor-cpus", parse_supervisor_cpus },
+};
+
+
+static int parse_token(merger_config_t *cfg, char *token) {
+  char *value = strchr(token, '=');
+  if (value == NULL) {
+    return -1;
+  }
+  *value++ = '\0';
+
+  for (size_t i = 0; i < sizeof(options_table) / sizeof(options_table[0]); ++i) {
+    if (strcmp(token, options_table[i].key) == 0) {
+      return options_table[i].handler(cfg, value);
+    }
+  }
+  return -1;
+}
+
+
+void merger_config_init(merger_config_t *cfg) {
+  memset(cfg, 0, sizeof(merger_config_t));
+  cfg->mode = CLIENT_MODE_DEFAULT;
+  cfg->format = FORMAT_MIDI1;
+  cfg->per_source = false;
+  cfg->stats = true;
+  cfg->coalesce = false;
+  cfg->overflow = OVERFLOW_DROP;
+  cfg->headroom = 256;
+  cfg->spill = 0;
+  cfg->spill_age_ms = 20;
+  cfg->sysex_pool = 0;
+  cfg->sysex_budget = 256;
+  midi_filter_init(&cfg->filter);
+  memset(cfg->rate_limits, 0, sizeof(cfg->rate_limits));
+  cfg->rate_limited = false;
+  cfg->clock_election = CLOCK_ALL;
+  cfg->clock_timeout = 4;
+  cfg->active_sensing_ms = 0;
+  cfg->num_routes = 0;
+  cfg->locked_memory = false;
+  cfg->supervisor_policy = SUPERVISOR_INHERIT;
+  cfg->supervisor_priority = 0;
+  cfg->supervisor_cpus = 0;
+  cfg->capture_size = 1 << 20;
+}
+
+
+int merger_config_parse(merger_config_t *cfg, const char *options) {
+  int errors = 0;
+
+  if (options == NULL) {
+    return 0;
+  }
+
+  const char *p = options;
+  while (*p != '\0') {
+    // Skip separators.
+    while (*p != '\0' && (isspace((unsigned char) *p) || *p == ';')) {
+      ++p;
+    }
+    if (*p == '\0') {
+      break;
+    }
+
+    const char *start = p;
+    while (*p != '\0' && !isspace((unsigned char) *p) && *p != ';') {
+      ++p;
+    }
+
+    char token[MAX_TOKEN_SIZE];
+    size_t length = (size_t) (p - start);
+    if (length >= sizeof(token)) {
+      fprintf(stderr, "Option too long: %.32s...\n", start);
+      ++errors;
+      continue;
+    }
+    memcpy(token, start, length);
+    token[length] = '\0';
+
+    if (parse_token(cfg, token) != 0) {
+      fprintf(stderr, "Invalid option: %.*s\n", (int) length, start);
+      ++errors;
+    }
+  }
+  return errors;
+}
+
+
+void merger_config_keep_fixed(merger_config_t *cfg, const merger_config_t *current) {
+  cfg->mode = current->mode;
+  cfg->format = current->format;
+  cfg->per_source = current->per_source;
+  cfg->num_routes = current->num_routes;
+  memcpy(cfg->route_patterns, current->route_patterns, sizeof(cfg->route_patterns));
+  memcpy(cfg->route_masks, current->route_masks, sizeof(cfg->route_masks));
+  cfg->spill = current->spill;
+  cfg->sysex_pool = current->sysex_pool;
+  cfg->locked_memory = current->locked_memory;
+  cfg->supervisor_policy = current->supervisor_policy;
+  cfg->supervisor_priority = current->supervisor_priority;
+  cfg->supervisor_cpus = current->supervisor_cpus;
+  cfg->stats = current->stats;
+  strcpy(cfg->stats_name, current->stats_name);
+  strcpy(cfg->control_path, current->control_path);
+  strcpy(cfg->capture_path, current->capture_path);
+  cfg->capture_size = current->capture_size;
+}
+
+
+int merger_config_priority(const merger_config_t *cfg, const char *port_name) {
+  for (int i = 0; i < cfg->num_priority_rules; ++i) {
+    if (strstr(port_name, cfg->priority_rules[i].pattern) != NULL) {
+      return cfg->priority_rules[i].priority;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,186 @@
+#ifndef MERGER_CONFIG_H
+#define MERGER_CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "merger-stats.h"
+#include "midi-filter.h"
+#include "midi-message.h"
+
+/* maximum number of `priority=` rules */
+#define MERGER_MAX_PRIORITY_RULES 16
+
+/* maximum number of broadcaster outputs of `route=` rules */
+#define MERGER_MAX_ROUTES 16
+
+/* maximum length of a port name pattern, including the terminator */
+#define MERGER_PATTERN_SIZE 64
+
+/* maximum length of the control socket path, including the terminator */
+#define MERGER_CONTROL_PATH_SIZE 108
+
+/* maximum length of the capture file path, including the terminator */
+#define MERGER_CAPTURE_PATH_SIZE 256
+
+typedef enum MERGER_OVERFLOW_POLICY {
+    // Drop whatever doesn't fit into the output buffer.
+    OVERFLOW_DROP,
+    // Keep `headroom` bytes free for Note Off, realtime and transport
+    // messages, only the latest value of continuous controllers is
+    // written once the rest of the buffer is full.
+    OVERFLOW_PROTECT
+} merger_overflow_policy_t;
+
+typedef enum MERGER_CLIENT_MODE {
+    // Whatever the loaded library is: `mod-midi-merger` merges,
+    // `mod-midi-broadcaster` broadcasts.
+    CLIENT_MODE_DEFAULT,
+    CLIENT_MODE_MERGER,
+    CLIENT_MODE_BROADCASTER,
+    // Both in one client, with one process callback.
+    CLIENT_MODE_BOTH
+} merger_client_mode_t;
+
+typedef enum MERGER_PORT_FORMAT {
+    // MIDI 1.0 byte messages.
+    FORMAT_MIDI1,
+    // MIDI 2.0 Universal MIDI Packets, one per event.
+    FORMAT_UMP
+} merger_port_format_t;
+
+typedef enum MERGER_CLOCK_ELECTION {
+    // Pass clock and transport messages of every source.
+    CLOCK_ALL,
+    // The first source that sends them is the clock master.
+    CLOCK_FIRST,
+    // Like `CLOCK_FIRST`, but a source with a higher priority takes
+    // over.
+    CLOCK_PRIORITY
+} merger_clock_election_t;
+
+typedef enum MERGER_SUPERVISOR_POLICY {
+    // Whatever the thread that loads the client has.
+    SUPERVISOR_INHERIT,
+    SUPERVISOR_OTHER,
+    SUPERVISOR_BATCH,
+    SUPERVISOR_IDLE,
+    SUPERVISOR_FIFO,
+    SUPERVISOR_RR
+} merger_supervisor_policy_t;
+
+typedef struct MERGER_PRIORITY_RULE_T {
+  char pattern[MERGER_PATTERN_SIZE];
+  int priority;
+} merger_priority_rule_t;
+
+/**
+ * Options of the merger, parsed from the `load_init` string.
+ *
+ * The string is a list of `key=value` tokens separated by white
+ * space or `;`, e.g. `inputs=per-source priority=Keystep:10`.
+ */
+typedef struct MERGER_CONFIG_T {
+  merger_client_mode_t mode;
+
+  // What the events on the merger's ports are.
+  merger_port_format_t format;
+
+  // Give every source its own input port instead of connecting all
+  // of them to `in`.
+  bool per_source;
+
+  int num_priority_rules;
+  merger_priority_rule_t priority_rules[MERGER_MAX_PRIORITY_RULES];
+
+  // Only keep the last value per channel and controller of control
+  // change, pitch bend and aftertouch within a cycle.
+  bool coalesce;
+
+  merger_overflow_policy_t overflow;
+  int headroom;
+
+  // Size in bytes of the queue for events carried over to the next
+  // cycle, 0 to drop them, and how long they may be carried.
+  int spill;
+  int spill_age_ms;
+
+  // Size in bytes of the pool for SysEx written in chunks across
+  // cycles, 0 to write SysEx as it comes, and the SysEx bytes written
+  // per cycle.
+  int sysex_pool;
+  int sysex_budget;
+
+  // `filter=`, `remap=` and `transpose=` rules.
+  midi_filter_t filter;
+
+  // Events per second and source of each message class, 0 for no
+  // limit. Notes and realtime messages are never limited.
+  uint32_t rate_limits[MSG_CLASS_COUNT];
+  bool rate_limited;
+
+  // Only clock and transport messages of the clock master are
+  // written. Another source is elected when the master misses
+  // `clock_timeout` ticks.
+  merger_clock_election_t clock_election;
+  int clock_timeout;
+
+  // At most one Active Sensing per interval is written, 0 writes all.
+  int active_sensing_ms;
+
+  // `route=` rules of the broadcaster. Destinations whose name contains
+  // a pattern get an output of their own, `route_masks` has the bits
+  // of the outputs an event is written to per status byte.
+  int num_routes;
+  char route_patterns[MERGER_MAX_ROUTES][MERGER_PATTERN_SIZE];
+  uint16_t route_masks[256];
+
+  // Allocate the state from one locked and prefaulted arena.
+  bool locked_memory;
+
+  // Scheduling of the supervisor thread, the priority is for `fifo`
+  // and `rr`. A bit per CPU it may run on, any if 0.
+  merger_supervisor_policy_t supervisor_policy;
+  int supervisor_priority;
+  uint64_t supervisor_cpus;
+
+  // Name of the shared memory segment for the stats, derived from the
+  // client name if empty.
+  bool stats;
+  char stats_name[MERGER_STATS_NAME_SIZE];
+
+  // UNIX socket for changing the options at runtime, none if empty.
+  char control_path[MERGER_CONTROL_PATH_SIZE];
+
+  // File the events are recorded to, none if empty, and the size in
+  // bytes of the ring they go through.
+  char capture_path[MERGER_CAPTURE_PATH_SIZE];
+  int capture_size;
+} merger_config_t;
+
+/**
+ * Set all options to their defaults.
+ */
+void merger_config_init(merger_config_t *cfg);
+
+/**
+ * Parse `options` on top of the current values of `cfg`.
+ * Returns 0 on success or the number of invalid tokens.
+ */
+int merger_config_parse(merger_config_t *cfg, const char *options);
+
+/**
+ * Copy the options that can't change at runtime from `current`:
+ * `mode`, `format`, `inputs`, `route`, `spill`, `sysex-pool`, `memory`,
+ * `supervisor`, `supervisor-cpus`, `stats`, `control`, `capture` and
+ * `capture-size`.
+ */
+void merger_config_keep_fixed(merger_config_t *cfg, const merger_config_t *current);
+
+/**
+ * Return the priority of a source port. The first rule whose pattern
+ * is contained in `port_name` wins, sources without a match get 0.
+ */
+int merger_config_priority(const merger_config_t *cfg, const char *port_name);
+
+#endif
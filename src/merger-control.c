@@ -0,0 +1,298 @@
+#include "merger-control.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* how long a client may take to send its command */
+#define CLIENT_TIMEOUT_MS 500
+
+
+static uint64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+
+static void set_flags(int fd) {
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+
+/**
+ * Whether `path` is a socket. Anything else there is not ours to
+ * remove.
+ */
+static bool is_socket(const char *path) {
+  struct stat st;
+  return lstat(path, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+
+/**
+ * Read one command, up to a newline, the end of the stream or the
+ * timeout. Returns 0, -EMSGSIZE if it is too long or -ESHUTDOWN if the
+ * control is closed meanwhile.
+ */
+static int read_command(const merger_control_t *control, int client,
+                        char *command, size_t size) {
+  const uint64_t deadline = now_ms() + CLIENT_TIMEOUT_MS;
+  size_t length = 0;
+
+  while (length < size - 1) {
+    const ssize_t got = read(client, command + length, size - 1 - length);
+    if (got > 0) {
+      length += (size_t) got;
+      if (memchr(command, '\n', length) != NULL) {
+        break;
+      }
+      continue;
+    }
+    if (got == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      break;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+
+    const uint64_t now = now_ms();
+    if (now >= deadline) {
+      break;
+    }
+    struct pollfd fds[2] = {
+      { .fd = client, .events = POLLIN },
+      { .fd = control->stop[0], .events = POLLIN },
+    };
+    const int rc = poll(fds, 2, (int) (deadline - now));
+    if (rc < 0 && errno != EINTR) {
+      break;
+    }
+    if (rc > 0 && fds[1].revents != 0) {
+      return -ESHUTDOWN;
+    }
+  }
+  command[length] = '\0';
+
+  char *const newline = strchr(command, '\n');
+  if (newline != NULL) {
+    *newline = '\0';
+  } else if (length == size - 1) {
+    return -EMSGSIZE;
+  }
+  return 0;
+}
+
+
+/**
+ * Serve one client. Returns false if the control is closed meanwhile.
+ */
+static bool serve_client(merger_control_t *control, int client) {
+  char command[MERGER_CONTROL_COMMAND_SIZE];
+  char reply[128];
+
+  const int rc = read_command(control, client, command, sizeof(command));
+  if (rc == -ESHUTDOWN) {
+    return false;
+  }
+  if (rc != 0) {
+    snprintf(reply, sizeof(reply), "error: command too long\n");
+  } else {
+    // Hand it to the supervisor and wait for the result.
+    memcpy(control->command, command, sizeof(command));
+    __atomic_store_n(&control->state, CONTROL_PENDING, __ATOMIC_RELEASE);
+    control->wake(control->wake_arg);
+
+    int result = -ETIMEDOUT;
+    bool answered = sem_timedwait_secs(&control->done, MERGER_CONTROL_APPLY_TIMEOUT) == 0;
+    if (!answered) {
+      // Take it back, unless the supervisor is applying it right now.
+      merger_control_state_t state = CONTROL_PENDING;
+      if (!__atomic_compare_exchange_n(&control->state, &state, CONTROL_IDLE, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        sem_wait(&control->done);
+        answered = true;
+      }
+    }
+    if (answered) {
+      if (__atomic_load_n(&control->state, __ATOMIC_ACQUIRE) != CONTROL_IDLE) {
+        // Woken up by `merger_control_close()`.
+        return false;
+      }
+      result = control->result;
+    }
+
+    if (result == 0) {
+      snprintf(reply, sizeof(reply), "ok\n");
+    } else if (result == -ETIMEDOUT) {
+      snprintf(reply, sizeof(reply), "error: not applied in time, try again\n");
+    } else if (result > 0) {
+      snprintf(reply, sizeof(reply), "error: %d invalid options\n", result);
+    } else {
+      snprintf(reply, sizeof(reply), "error: %s\n", strerror(-result));
+    }
+  }
+
+  if (write(client, reply, strlen(reply)) < 0) {
+    // The client is gone, nothing to do.
+  }
+  return true;
+}
+
+
+static void *control_thread(void *arg) {
+  merger_control_t *const control = (merger_control_t *const) arg;
+
+  for (;;) {
+    struct pollfd fds[2] = {
+      { .fd = control->socket, .events = POLLIN },
+      { .fd = control->stop[0], .events = POLLIN },
+    };
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Can't wait for control clients");
+      return NULL;
+    }
+    if (fds[1].revents != 0) {
+      return NULL;
+    }
+
+    const int client = accept(control->socket, NULL, NULL);
+    if (client < 0) {
+      // Gone again, or EINTR.
+      continue;
+    }
+    // Whether the accepted socket inherits O_NONBLOCK differs.
+    set_flags(client);
+    const bool open = serve_client(control, client);
+    close(client);
+    if (!open) {
+      return NULL;
+    }
+  }
+}
+
+
+int merger_control_open(merger_control_t *control, const char *path,
+                        void (*wake)(void *arg), void *wake_arg) {
+  struct sockaddr_un address;
+
+  memset(control, 0, sizeof(merger_control_t));
+  control->socket = -1;
+  control->wake = wake;
+  control->wake_arg = wake_arg;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Control socket path too long: %s\n", path);
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  // Only an old socket is replaced, never a file the path names by
+  // mistake.
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Control socket %s exists and is not a socket.\n", path);
+      return -1;
+    }
+    unlink(path);
+  } else if (errno != ENOENT) {
+    fprintf(stderr, "Can't use control socket %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  const int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket_fd < 0) {
+    perror("Can't create control socket");
+    return -1;
+  }
+  set_flags(socket_fd);
+
+  if (bind(socket_fd, (const struct sockaddr *) &address, sizeof(address)) != 0
+      || listen(socket_fd, 4) != 0) {
+    perror("Can't listen on control socket");
+    close(socket_fd);
+    return -1;
+  }
+  if (pipe(control->stop) != 0) {
+    perror("Can't create control socket");
+    close(socket_fd);
+    unlink(path);
+    return -1;
+  }
+  set_flags(control->stop[0]);
+  set_flags(control->stop[1]);
+
+  control->socket = socket_fd;
+  sem_init(&control->done, 0, 0);
+  if (pthread_create(&control->thread, NULL, control_thread, control) != 0) {
+    fprintf(stderr, "Can't create control thread\n");
+    sem_destroy(&control->done);
+    close(control->stop[0]);
+    close(control->stop[1]);
+    close(socket_fd);
+    unlink(path);
+    control->socket = -1;
+    return -1;
+  }
+  return 0;
+}
+
+
+void merger_control_serve(merger_control_t *control, merger_control_handler_t handler,
+                          void *arg) {
+  merger_control_state_t state = CONTROL_PENDING;
+  if (!__atomic_compare_exchange_n(&control->state, &state, CONTROL_APPLYING, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  const int result = handler(arg, control->command);
+  if (result == -EAGAIN) {
+    // Again on the next wakeup, if the thread still waits for it.
+    __atomic_store_n(&control->state, CONTROL_PENDING, __ATOMIC_RELEASE);
+    return;
+  }
+  control->result = result;
+  __atomic_store_n(&control->state, CONTROL_IDLE, __ATOMIC_RELEASE);
+  sem_post(&control->done);
+}
+
+
+void merger_control_close(merger_control_t *control, const char *path) {
+  if (control->socket < 0) {
+    return;
+  }
+
+  // The supervisor is gone, a command it didn't take is answered by
+  // nobody.
+  const char stop = 0;
+  if (write(control->stop[1], &stop, 1) < 0) {
+    perror("Can't stop the control thread");
+  }
+  sem_post(&control->done);
+  pthread_join(control->thread, NULL);
+
+  sem_destroy(&control->done);
+  close(control->stop[0]);
+  close(control->stop[1]);
+  close(control->socket);
+  control->socket = -1;
+  if (is_socket(path)) {
+    unlink(path);
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef MERGER_CONTROL_H
+#define MERGER_CONTROL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "mod-semaphore.h"
+
+/* longest command accepted on the control socket */
+#define MERGER_CONTROL_COMMAND_SIZE 1024
+
+/* seconds a command may wait for the supervisor before the client
+   gets an error */
+#define MERGER_CONTROL_APPLY_TIMEOUT 1
+
+/**
+ * Apply a command. Returns 0 on success, the number of invalid
+ * options or a negative error number. With -EAGAIN the command stays
+ * waiting and the handler is called again on a later wakeup.
+ */
+typedef int (*merger_control_handler_t)(void *arg, const char *command);
+
+typedef enum MERGER_CONTROL_STATE {
+    // No command.
+    CONTROL_IDLE,
+    // A command for the supervisor.
+    CONTROL_PENDING,
+    // The supervisor is applying it, the thread waits for the result.
+    CONTROL_APPLYING
+} merger_control_state_t;
+
+/**
+ * The control socket. Its own thread sleeps until a client connects,
+ * reads the command and hands it to the supervisor, which applies it
+ * in `merger_control_serve()`. The supervisor never waits for a
+ * client and nothing wakes up while there are none.
+ */
+typedef struct MERGER_CONTROL_T {
+  int socket;
+  // Written to by `merger_control_close()` to stop the thread.
+  int stop[2];
+  pthread_t thread;
+
+  // Called by the thread when a command is waiting.
+  void (*wake)(void *arg);
+  void *wake_arg;
+
+  // The command handed to the supervisor. The thread sets `state` to
+  // pending, the supervisor takes it and posts `done` with the result.
+  // A command still pending after the timeout is taken back by the
+  // thread.
+  char command[MERGER_CONTROL_COMMAND_SIZE];
+  merger_control_state_t state;
+  int result;
+  sem_t done;
+} merger_control_t;
+
+/**
+ * Listen on the UNIX socket `path` and start the thread. An old socket
+ * file is replaced, any other file is left alone and fails. `wake` is
+ * called when a command is waiting. Returns 0 on success.
+ */
+int merger_control_open(merger_control_t *control, const char *path,
+                        void (*wake)(void *arg), void *wake_arg);
+
+static inline bool merger_control_active(const merger_control_t *control) {
+  return control->socket >= 0;
+}
+
+/**
+ * Apply the waiting command, if any. The client gets `ok` or
+ * `error: <reason>` back, also if it is not applied within
+ * `MERGER_CONTROL_APPLY_TIMEOUT` seconds. It is called in the
+ * non-realtime context and does not block.
+ */
+void merger_control_serve(merger_control_t *control, merger_control_handler_t handler,
+                          void *arg);
+
+/**
+ * Stop the thread, close the socket and remove the socket file. A
+ * control that was never opened is fine too.
+ */
+void merger_control_close(merger_control_t *control, const char *path);
+
+#endif
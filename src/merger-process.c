@@ -0,0 +1,1090 @@
+#include "midi-merger.h"
+#include "midi-message.h"
+#include "ump.h"
+
+#include <time.h>
+
+/*
+ * The realtime part of the merger. It only uses the Jack MIDI buffer
+ * API, so it can be linked against a mock for benchmarks.
+ */
+
+static inline void count_input(midi_merger_t *const mm, const jack_midi_event_t *event) {
+  ++mm->process_stats.events_in;
+  mm->process_stats.bytes_in += event->size;
+}
+
+
+static inline uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+
+/**
+ * Record an event, `source` is the input order or `CAPTURE_OUT`.
+ */
+static void capture_event(midi_merger_t *const mm, const jack_midi_event_t *event,
+                          uint8_t source) {
+  if (merger_capture_event(&mm->capture, mm->frames + event->time, source,
+                           event->buffer, event->size)) {
+    ++mm->process_stats.captured;
+  } else {
+    rt_log(&mm->core->log, LOG_CAPTURE_FULL, 0, 0);
+    ++mm->process_stats.capture_lost;
+    mm->wake_supervisor = true;
+  }
+}
+
+
+/**
+ * Record what went to `out` in this cycle. The supervisor is woken up
+ * early when the ring fills up.
+ */
+static void capture_output(midi_merger_t *const mm, void *output_port_buffer) {
+  const jack_nframes_t count = jack_midi_get_event_count(output_port_buffer);
+  jack_midi_event_t event;
+
+  for (jack_nframes_t i = 0; i < count; ++i) {
+    if (jack_midi_event_get(&event, output_port_buffer, i) == 0) {
+      capture_event(mm, &event, CAPTURE_OUT);
+    }
+  }
+  if (merger_capture_pending(&mm->capture) > mm->capture.size / 2) {
+    mm->wake_supervisor = true;
+  }
+}
+
+
+/**
+ * Update the per-cycle counters and publish all of them.
+ */
+static void finish_cycle_stats(midi_merger_t *const mm, uint64_t start_ns,
+                               uint64_t events_before) {
+  merger_process_stats_t *const stats = &mm->process_stats;
+  const uint64_t events = stats->events_in - events_before;
+  const uint64_t elapsed = now_ns() - start_ns;
+
+  ++stats->cycles;
+  if (events > stats->max_events_per_cycle) {
+    stats->max_events_per_cycle = events;
+  }
+  ++stats->process_time[merger_stats_bucket(elapsed)];
+  if (elapsed > stats->max_process_time_ns) {
+    stats->max_process_time_ns = elapsed;
+  }
+
+  merger_stats_publish_process(mm->stats, stats);
+}
+
+
+/**
+ * Queue an event for the next cycle.
+ */
+static void spill_event(midi_merger_t *const mm, jack_nframes_t time,
+                        const jack_midi_data_t *data, size_t size) {
+  if (spill_queue_push(&mm->spill, mm->frames + time, data, size)) {
+    ++mm->process_stats.spilled;
+    mm->spill_backlog = true;
+  } else {
+    rt_log(&mm->core->log, LOG_SPILL_FULL, 0, 0);
+    ++mm->process_stats.drops[DROP_SPILL_FULL];
+    mm->wake_supervisor = true;
+  }
+}
+
+
+/**
+ * Write one event to the output buffer. Events that don't fit go to
+ * the spill queue if there is one. Failures are logged and the
+ * supervisor is woken up at the end of the cycle to print them.
+ */
+static void output_event(midi_merger_t *const mm, void *output_port_buffer,
+                         jack_nframes_t time, const jack_midi_data_t *data, size_t size) {
+  int result;
+  result = jack_midi_event_write(output_port_buffer, time, data, size);
+  switch(result) {
+  case 0:
+    // Fine.
+    ++mm->process_stats.events_out;
+    mm->process_stats.bytes_out += size;
+    break;
+  case ENOBUFS:
+    if (mm->spill.data_size > 0) {
+      spill_event(mm, time, data, size);
+      break;
+    }
+    rt_log(&mm->core->log, LOG_NO_BUFFER_SPACE, 0, 0);
+    ++mm->process_stats.drops[DROP_NO_BUFFER_SPACE];
+    mm->wake_supervisor = true;
+    break;
+  default:
+    rt_log(&mm->core->log, LOG_WRITE_FAILED, result, 0);
+    ++mm->process_stats.drops[DROP_WRITE_FAILED];
+    mm->wake_supervisor = true;
+    break;
+  }
+}
+
+
+/**
+ * Write the events carried over from the last cycles at frame 0, in
+ * their original order. Events older than the maximum age are dropped.
+ * Whatever doesn't fit stays queued.
+ */
+static void flush_spill(midi_merger_t *const mm, void *output_port_buffer) {
+  spill_queue_t *const spill = &mm->spill;
+  const spill_event_t *event;
+
+  while ((event = spill_queue_front(spill)) != NULL) {
+    if (mm->frames - event->due > __atomic_load_n(&mm->spill_max_age, __ATOMIC_RELAXED)) {
+      ++mm->process_stats.drops[DROP_SPILL_EXPIRED];
+      spill_queue_pop(spill);
+      continue;
+    }
+
+    if (jack_midi_event_write(output_port_buffer, 0,
+                              spill_queue_data(spill, event), event->size) != 0) {
+      break;
+    }
+    ++mm->process_stats.events_out;
+    mm->process_stats.bytes_out += event->size;
+    spill_queue_pop(spill);
+  }
+
+  mm->spill_backlog = spill->count > 0;
+}
+
+
+static inline bool is_sysex(const jack_midi_data_t *data) {
+  return data[0] == 0xf0 || data[0] == 0xf7;
+}
+
+
+/**
+ * Whether a SysEx message is partly written or events are held back
+ * behind one. Anything but realtime messages has to wait then.
+ */
+static inline bool sysex_open(const midi_merger_t *const mm) {
+  return mm->sysex_written > 0 || mm->sysex_held > 0;
+}
+
+
+/**
+ * Add an event to the SysEx pool.
+ */
+static bool sysex_push(midi_merger_t *const mm, jack_nframes_t time,
+                       const jack_midi_data_t *data, size_t size) {
+  if (spill_queue_push(&mm->sysex, mm->frames + time, data, size)) {
+    return true;
+  }
+  ++mm->process_stats.drops[DROP_SYSEX_POOL_FULL];
+  return false;
+}
+
+
+/**
+ * Hold an event back until the partly written SysEx is complete.
+ */
+static void sysex_hold(midi_merger_t *const mm, jack_nframes_t time,
+                       const jack_midi_data_t *data, size_t size) {
+  if (sysex_push(mm, time, data, size)) {
+    ++mm->sysex_held;
+    ++mm->process_stats.sysex_held;
+  }
+}
+
+
+/**
+ * SysEx segmentation. SysEx that doesn't fit into what is left of the
+ * budget of this cycle, or would overtake pooled SysEx, goes to the
+ * pool, split into its messages. Other events are held back while a
+ * message is partly written. Returns true if the event was taken.
+ */
+static bool pool_sysex(midi_merger_t *const mm, const jack_midi_event_t *event) {
+  if (event->buffer[0] >= 0xf8) {
+    // Realtime messages may go in between SysEx bytes.
+    return false;
+  }
+
+  if (!is_sysex(event->buffer)) {
+    if (!sysex_open(mm)) {
+      return false;
+    }
+    sysex_hold(mm, event->time, event->buffer, event->size);
+    return true;
+  }
+
+  if (mm->sysex.count == 0 && event->size <= mm->sysex_budget_left) {
+    mm->sysex_budget_left -= event->size;
+    return false;
+  }
+
+  // Dumps often come as several messages in one event, receivers may
+  // get other events in between them.
+  size_t start = 0;
+  for (size_t i = 1; i <= event->size; ++i) {
+    if (i == event->size || (event->buffer[i - 1] == 0xf7 && event->buffer[i] == 0xf0)) {
+      if (!sysex_push(mm, event->time, event->buffer + start, i - start)) {
+        break;
+      }
+      start = i;
+    }
+  }
+  return true;
+}
+
+
+/**
+ * Write from the SysEx pool at frame 0, SysEx up to the budget of this
+ * cycle and the headroom of the overflow policy. A message that doesn't
+ * fit any more is continued in the next cycle.
+ */
+static void drain_sysex(midi_merger_t *const mm, void *output_port_buffer) {
+  spill_queue_t *const pool = &mm->sysex;
+  const spill_event_t *event;
+
+  while ((event = spill_queue_front(pool)) != NULL) {
+    const jack_midi_data_t *const data = spill_queue_data(pool, event);
+    size_t size = event->size;
+
+    if (is_sysex(data)) {
+      size_t space = jack_midi_max_event_size(output_port_buffer);
+      if (mm->config_in_use->overflow == OVERFLOW_PROTECT) {
+        const size_t headroom = (size_t) mm->config_in_use->headroom;
+        space = space > headroom ? space - headroom : 0;
+      }
+      size -= mm->sysex_written;
+      if (size > mm->sysex_budget_left) {
+        size = mm->sysex_budget_left;
+      }
+      if (size > space) {
+        size = space;
+      }
+    }
+
+    if (size == 0
+        || jack_midi_event_write(output_port_buffer, 0, data + mm->sysex_written, size) != 0) {
+      break;
+    }
+    ++mm->process_stats.events_out;
+    mm->process_stats.bytes_out += size;
+
+    if (!is_sysex(data)) {
+      --mm->sysex_held;
+    } else {
+      ++mm->process_stats.sysex_chunks;
+      mm->sysex_budget_left -= size;
+      mm->sysex_written += (uint32_t) size;
+      if (mm->sysex_written < event->size) {
+        break;
+      }
+      if (size < event->size) {
+        ++mm->process_stats.sysex_segmented;
+      }
+      mm->sysex_written = 0;
+    }
+    spill_queue_pop(pool);
+  }
+}
+
+
+/**
+ * Replace a packet by its MIDI 1.0 view, see `ump_midi1_view()`.
+ * Returns false if there is none.
+ */
+static inline bool view_packet(jack_midi_event_t *event, jack_midi_data_t view[3]) {
+  uint32_t words[UMP_MAX_PACKET_SIZE / 4];
+  if (event->size > sizeof(words)) {
+    return false;
+  }
+  memcpy(words, event->buffer, event->size);
+  event->size = ump_midi1_view(words, event->size, view);
+  event->buffer = view;
+  return event->size > 0;
+}
+
+
+/**
+ * Messages that may use the headroom: Note Off, realtime (including
+ * Start, Continue and Stop) and Song Position.
+ */
+static inline bool is_protected(const jack_midi_data_t *data, midi_message_class_t cls) {
+  return cls == MSG_NOTE_OFF || cls == MSG_REALTIME || data[0] == 0xf2;
+}
+
+
+/**
+ * An event that doesn't fit outside the headroom. Continuous controller
+ * values are kept for the end of the cycle, newer values replace older
+ * ones. Anything else is carried over to the next cycle or dropped.
+ */
+static void hold_back(midi_merger_t *const mm, const jack_midi_event_t *event,
+                      midi_message_class_t cls) {
+  if (midi_is_continuous(cls) && event->size <= 3) {
+    bool added;
+    controller_slot_t *const slot = controller_slots_get(&mm->overflow_slots,
+                                                         midi_continuous_key(event->buffer, event->size, cls),
+                                                         &added);
+    if (slot != NULL) {
+      if (!added) {
+        ++mm->process_stats.drops[DROP_SUPERSEDED];
+      }
+      slot->time = event->time;
+      slot->size = (uint8_t) event->size;
+      memcpy(slot->data, event->buffer, event->size);
+      return;
+    }
+  }
+
+  if (mm->spill.data_size > 0) {
+    spill_event(mm, event->time, event->buffer, event->size);
+    return;
+  }
+
+  ++mm->process_stats.drops[DROP_OVERFLOW];
+  rt_log(&mm->core->log, LOG_OVERFLOW, 0, 0);
+  mm->wake_supervisor = true;
+}
+
+
+/**
+ * Write the controller values held back in this cycle. They go after
+ * everything else, the headroom is not needed any more.
+ */
+static void flush_held_back(midi_merger_t *const mm, void *output_port_buffer,
+                            jack_nframes_t nframes) {
+  controller_slots_t *const slots = &mm->overflow_slots;
+
+  for (uint32_t i = 0; i < slots->count; ++i) {
+    const controller_slot_t *const slot = &slots->slots[i];
+    ++mm->process_stats.overflow_deferred;
+    if (sysex_open(mm)) {
+      sysex_hold(mm, nframes - 1, slot->data, slot->size);
+    } else if (mm->spill_backlog) {
+      spill_event(mm, nframes - 1, slot->data, slot->size);
+    } else {
+      output_event(mm, output_port_buffer, nframes - 1, slot->data, slot->size);
+    }
+  }
+  controller_slots_reset(slots);
+}
+
+
+/**
+ * Write one event, applying the overflow policy. Once anything was
+ * carried over, later events queue up behind it to keep their order.
+ */
+static void write_event(midi_merger_t *const mm, void *output_port_buffer,
+                        const jack_midi_event_t *event) {
+  if (mm->sysex.data_size > 0 && event->size > 0 && pool_sysex(mm, event)) {
+    return;
+  }
+  if (mm->spill_backlog) {
+    spill_event(mm, event->time, event->buffer, event->size);
+    return;
+  }
+
+  if (mm->config_in_use->overflow == OVERFLOW_PROTECT && event->size > 0) {
+    const size_t space = jack_midi_max_event_size(output_port_buffer);
+    const size_t headroom = (size_t) mm->config_in_use->headroom;
+
+    if (space < event->size + headroom) {
+      // Packets are classified by their view, they are never held back
+      // as controller values.
+      jack_midi_event_t message = *event;
+      jack_midi_data_t view[3];
+      if (mm->config_in_use->format == FORMAT_UMP && !view_packet(&message, view)) {
+        message.size = 0;
+      }
+      const midi_message_class_t cls = midi_classify(message.buffer, message.size);
+      if (message.size == 0 || !is_protected(message.buffer, cls)) {
+        hold_back(mm, event, cls);
+        return;
+      }
+      ++mm->process_stats.overflow_protected;
+    }
+  }
+
+  output_event(mm, output_port_buffer, event->time, event->buffer, event->size);
+}
+
+
+/**
+ * Merge order of two cursors: earlier events first, then higher
+ * priority, then the order the inputs were added.
+ */
+static inline bool merges_before(const merge_cursor_t *a, const merge_cursor_t *b) {
+  if (a->event.time != b->event.time) {
+    return a->event.time < b->event.time;
+  }
+  if (a->priority != b->priority) {
+    return a->priority > b->priority;
+  }
+  return a->order < b->order;
+}
+
+
+static void sift_down(merge_cursor_t *heap, int size, int i) {
+  for (;;) {
+    int first = i;
+    const int left = 2*i + 1;
+    const int right = left + 1;
+
+    if (left < size && merges_before(&heap[left], &heap[first])) {
+      first = left;
+    }
+    if (right < size && merges_before(&heap[right], &heap[first])) {
+      first = right;
+    }
+    if (first == i) {
+      return;
+    }
+
+    const merge_cursor_t tmp = heap[i];
+    heap[i] = heap[first];
+    heap[first] = tmp;
+    i = first;
+  }
+}
+
+
+/**
+ * Add an input buffer to the merge heap if it has any events.
+ */
+static void add_input(merge_cursor_t *heap, int *size, void *buffer,
+                      int priority, int order) {
+  const jack_nframes_t count = jack_midi_get_event_count(buffer);
+  if (count == 0) {
+    return;
+  }
+
+  merge_cursor_t *const cursor = &heap[*size];
+  cursor->buffer = buffer;
+  cursor->count = count;
+  cursor->index = 0;
+  cursor->priority = priority;
+  cursor->order = order;
+  if (jack_midi_event_get(&cursor->event, buffer, 0) == 0) {
+    ++*size;
+  }
+}
+
+
+/**
+ * Apply the filter and remap rules to `event`. Rewritten messages are
+ * stored in `scratch`. Returns false if the event is dropped.
+ */
+static inline bool filter_event(const midi_filter_t *filter, jack_midi_event_t *event,
+                                jack_midi_data_t scratch[3]) {
+  const jack_midi_data_t *const data = midi_filter_apply(filter, event->buffer,
+                                                         event->size, scratch);
+  if (data == NULL) {
+    return false;
+  }
+  event->buffer = (jack_midi_data_t *) data;
+  return true;
+}
+
+
+/**
+ * Last-value-wins coalescing, first pass: remember where the last
+ * value of each continuous controller in this cycle comes from. The
+ * order is the same as in `merges_before()`.
+ */
+static void scan_last_values(midi_merger_t *const mm, void *buffer, jack_nframes_t count,
+                             int priority, int order) {
+  jack_midi_event_t event;
+  jack_midi_data_t view[3];
+  jack_midi_data_t scratch[3];
+
+  for (jack_nframes_t i = 0; i < count; ++i) {
+    if (jack_midi_event_get(&event, buffer, i) != 0
+        || (mm->config_in_use->format == FORMAT_UMP && !view_packet(&event, view))
+        || !filter_event(&mm->config_in_use->filter, &event, scratch)) {
+      continue;
+    }
+    const midi_message_class_t cls = midi_classify(event.buffer, event.size);
+    if (!midi_is_continuous(cls) || event.size > 3) {
+      continue;
+    }
+
+    bool added;
+    controller_slot_t *const slot = controller_slots_get(&mm->coalesce_slots,
+                                                         midi_continuous_key(event.buffer, event.size, cls),
+                                                         &added);
+    if (slot == NULL) {
+      // Table full, the key is passed through as is.
+      continue;
+    }
+    if (!added) {
+      const bool later = event.time > slot->time
+                      || (event.time == slot->time
+                          && (priority < slot->priority
+                              || (priority == slot->priority && order >= slot->source)));
+      if (!later) {
+        continue;
+      }
+    }
+    slot->time = event.time;
+    slot->priority = priority;
+    slot->source = (uint8_t) order;
+    slot->index = i;
+  }
+}
+
+
+static inline int input_priority(midi_merger_t *const mm, int order) {
+  return order > 0 ? __atomic_load_n(&mm->sources[order - 1].priority, __ATOMIC_RELAXED) : 0;
+}
+
+
+/**
+ * Clock master election. Returns true if clock and transport messages
+ * from the input `order` are written. The master is replaced when it
+ * missed `clock_timeout` ticks, with the priority election also by a
+ * source that outranks it.
+ */
+static bool from_clock_master(midi_merger_t *const mm, const merger_config_t *cfg,
+                              int order, uint8_t status, uint64_t frame) {
+  merger_process_stats_t *const stats = &mm->process_stats;
+
+  if (mm->clock_master != order) {
+    // Until the master's tempo is known, a tenth of a second per tick.
+    const uint64_t interval = mm->clock_interval > 0 ? mm->clock_interval : mm->sample_rate / 10;
+    const bool silent = mm->clock_master >= 0
+                     && frame - mm->clock_last_tick > (uint64_t) cfg->clock_timeout * interval;
+    const bool outranks = mm->clock_master >= 0 && cfg->clock_election == CLOCK_PRIORITY
+                       && input_priority(mm, order) > input_priority(mm, mm->clock_master);
+    if (mm->clock_master >= 0 && !silent && !outranks) {
+      return false;
+    }
+
+    if (silent) {
+      ++stats->clock_failovers;
+    }
+    ++stats->clock_elections;
+    stats->clock_master = (uint64_t) order + 1;
+    mm->clock_master = order;
+    mm->clock_last_tick = frame;
+    mm->clock_interval = 0;
+  }
+
+  if (status == 0xf8) {
+    if (frame > mm->clock_last_tick) {
+      mm->clock_interval = frame - mm->clock_last_tick;
+    }
+    mm->clock_last_tick = frame;
+  }
+  return true;
+}
+
+
+/**
+ * The realtime stage for system messages: clock and transport only
+ * from the clock master, Active Sensing at most once per interval.
+ * Returns false if the event is dropped.
+ */
+static inline bool pass_system_message(midi_merger_t *const mm, const merger_config_t *cfg,
+                                       const jack_midi_event_t *event, int order) {
+  const uint8_t status = event->buffer[0];
+  const uint64_t frame = mm->frames + event->time;
+
+  switch (status) {
+  case 0xf2: // Song Position
+  case 0xf8: // Clock
+  case 0xfa: // Start
+  case 0xfb: // Continue
+  case 0xfc: // Stop
+    if (cfg->clock_election != CLOCK_ALL
+        && !from_clock_master(mm, cfg, order, status, frame)) {
+      ++mm->process_stats.drops[DROP_REDUNDANT_CLOCK];
+      return false;
+    }
+    return true;
+  case 0xfe: // Active Sensing
+    if (cfg->active_sensing_ms > 0) {
+      if (frame < mm->sensing_due) {
+        ++mm->process_stats.drops[DROP_REDUNDANT_SENSING];
+        return false;
+      }
+      mm->sensing_due = frame + (uint64_t) cfg->active_sensing_ms * mm->sample_rate / 1000;
+    }
+    return true;
+  default:
+    return true;
+  }
+}
+
+
+/**
+ * The held notes of the input with the merge `order`.
+ */
+static inline note_state_t *input_notes(midi_merger_t *const mm, int order) {
+  return order > 0 ? &mm->sources[order - 1].notes : &mm->in_notes;
+}
+
+
+/**
+ * A continuous value over the rate limit. Only the newest one per
+ * channel and controller is kept, until the bucket of its input has a
+ * token again. `view` is the message, `event` what is written.
+ */
+static void hold_throttled(midi_merger_t *const mm, const jack_midi_event_t *view,
+                           midi_message_class_t cls, int order, const jack_midi_event_t *event) {
+  controller_slots_t *const slots = &mm->throttle_slots;
+  bool added;
+  controller_slot_t *const slot = event->size <= UMP_MAX_PACKET_SIZE
+                                ? controller_slots_get(slots, midi_continuous_key(view->buffer, view->size, cls),
+                                                       &added)
+                                : NULL;
+  if (slot == NULL) {
+    // No room, it is lost.
+    ++mm->process_stats.drops[DROP_THROTTLED];
+    return;
+  }
+
+  throttled_value_t *const value = &mm->throttled[slot - slots->slots];
+  if (!added && value->size > 0) {
+    ++mm->process_stats.drops[DROP_THROTTLED];
+  }
+  slot->source = (uint8_t) order;
+  value->cls = (uint8_t) cls;
+  value->size = (uint8_t) event->size;
+  memcpy(value->data, event->buffer, event->size);
+}
+
+
+/**
+ * A newer value of a continuous controller is written, one held back
+ * by the rate limits is out of date.
+ */
+static inline void supersede_throttled(midi_merger_t *const mm, const jack_midi_event_t *view,
+                                       midi_message_class_t cls) {
+  controller_slots_t *const slots = &mm->throttle_slots;
+  const controller_slot_t *const slot = controller_slots_find(slots,
+                                                              midi_continuous_key(view->buffer, view->size, cls));
+  if (slot != NULL && mm->throttled[slot - slots->slots].size > 0) {
+    mm->throttled[slot - slots->slots].size = 0;
+    ++mm->process_stats.drops[DROP_THROTTLED];
+  }
+}
+
+
+/**
+ * Forget the values held back by the rate limits for an input that is
+ * gone, they would come after its notes and pedals were ended.
+ */
+static void drop_throttled(midi_merger_t *const mm, int order) {
+  controller_slots_t *const slots = &mm->throttle_slots;
+
+  for (uint32_t i = 0; i < slots->count; ++i) {
+    if (mm->throttled[i].size > 0 && slots->slots[i].source == order) {
+      mm->throttled[i].size = 0;
+      ++mm->process_stats.drops[DROP_THROTTLED];
+    }
+  }
+}
+
+
+/**
+ * Write the values held back by the rate limits whose buckets allow it
+ * again, at the start of the cycle. The rest waits for the next one.
+ */
+static void flush_throttled(midi_merger_t *const mm, void *output_port_buffer) {
+  controller_slots_t *const slots = &mm->throttle_slots;
+  const merger_config_t *const cfg = mm->config_in_use;
+  bool waiting = false;
+
+  for (uint32_t i = 0; i < slots->count; ++i) {
+    throttled_value_t *const value = &mm->throttled[i];
+    if (value->size == 0) {
+      continue;
+    }
+    const uint32_t rate = cfg->rate_limits[value->cls];
+    if (rate > 0 && !rate_bucket_take(&mm->rate_buckets[slots->slots[i].source][value->cls],
+                                      mm->frames, rate, mm->sample_rate)) {
+      waiting = true;
+      continue;
+    }
+    const jack_midi_event_t event = { 0, value->size, value->data };
+    write_event(mm, output_port_buffer, &event);
+    value->size = 0;
+
+    // A sustain pedal counts as held once it is written, packets by
+    // their view in group 1.
+    jack_midi_event_t message = event;
+    jack_midi_data_t view[3];
+    uint32_t word;
+    memcpy(&word, value->data, sizeof(word));
+    if (cfg->format != FORMAT_UMP || (ump_group(word) == 0 && view_packet(&message, view))) {
+      note_state_update(input_notes(mm, slots->slots[i].source), message.buffer, message.size);
+    }
+  }
+
+  if (!waiting) {
+    controller_slots_reset(slots);
+  }
+}
+
+
+typedef enum STAGE_RESULT {
+    STAGE_PASS,
+    STAGE_DROP,
+    // A continuous value over the rate limit, for `hold_throttled()`.
+    STAGE_HOLD
+} stage_result_t;
+
+
+/**
+ * The stages after the filter: redundant system messages, coalescing
+ * and rate limits. Values coalescing drops don't take a token, so the
+ * one it keeps is only held back if the rate is really exceeded.
+ */
+static inline stage_result_t pass_stages(midi_merger_t *const mm, const jack_midi_event_t *event,
+                                         int order, jack_nframes_t index,
+                                         midi_message_class_t *cls_out) {
+  const merger_config_t *const cfg = mm->config_in_use;
+  if (event->size > 0 && event->buffer[0] >= 0xf2
+      && !pass_system_message(mm, cfg, event, order)) {
+    return STAGE_DROP;
+  }
+
+  // Both need the message class, most configurations have neither.
+  if (cfg->rate_limited || cfg->coalesce) {
+    const midi_message_class_t cls = midi_classify(event->buffer, event->size);
+    const bool continuous = midi_is_continuous(cls) && event->size <= 3;
+    *cls_out = cls;
+
+    if (cfg->coalesce && continuous) {
+      const controller_slot_t *const slot = controller_slots_find(&mm->coalesce_slots,
+                                                                  midi_continuous_key(event->buffer, event->size, cls));
+      if (slot != NULL && (slot->source != order || slot->index != index)) {
+        ++mm->process_stats.drops[DROP_COALESCED];
+        return STAGE_DROP;
+      }
+    }
+
+    const uint32_t rate = cfg->rate_limits[cls];
+    if (rate > 0) {
+      if (!rate_bucket_take(&mm->rate_buckets[order][cls], mm->frames + event->time,
+                            rate, mm->sample_rate)) {
+        ++mm->process_stats.throttled[order];
+        if (continuous) {
+          return STAGE_HOLD;
+        }
+        ++mm->process_stats.drops[DROP_THROTTLED];
+        return STAGE_DROP;
+      }
+      if (continuous && mm->throttle_slots.count > 0) {
+        supersede_throttled(mm, event, cls);
+      }
+    }
+  }
+  return STAGE_PASS;
+}
+
+
+/**
+ * `merge_event()` for UMP. The filter and the stages see the MIDI 1.0
+ * view of a packet, a new status or note number is written back to it.
+ * Packets without a view pass unchanged. Held notes are only tracked
+ * in group 1, the group of the Note Offs for unplugged sources.
+ */
+static void merge_packet(midi_merger_t *const mm, void *output_port_buffer,
+                         const jack_midi_event_t *input, int order, jack_nframes_t index) {
+  count_input(mm, input);
+
+  uint32_t words[UMP_MAX_PACKET_SIZE / 4];
+  jack_midi_data_t view[3];
+  size_t view_size = 0;
+  if (input->size <= sizeof(words)) {
+    memcpy(words, input->buffer, input->size);
+    view_size = ump_midi1_view(words, input->size, view);
+  }
+  if (view_size == 0) {
+    write_event(mm, output_port_buffer, input);
+    return;
+  }
+
+  jack_midi_data_t scratch[3];
+  jack_midi_event_t event = { input->time, view_size, view };
+  if (!filter_event(&mm->config_in_use->filter, &event, scratch)) {
+    ++mm->process_stats.drops[DROP_FILTERED];
+    return;
+  }
+  midi_message_class_t cls;
+  const stage_result_t result = pass_stages(mm, &event, order, index, &cls);
+  if (result == STAGE_DROP) {
+    return;
+  }
+
+  ump_apply_view(words, event.buffer);
+  const jack_midi_event_t packet = { input->time, input->size, (jack_midi_data_t *) words };
+  if (result == STAGE_HOLD) {
+    hold_throttled(mm, &event, cls, order, &packet);
+    return;
+  }
+  if (ump_group(words[0]) == 0) {
+    note_state_update(input_notes(mm, order), event.buffer, event.size);
+  }
+  write_event(mm, output_port_buffer, &packet);
+}
+
+
+/**
+ * Handle one event read from the input with the merge `order`: count
+ * it, apply the filter rules, drop redundant system messages, rate
+ * limited events and continuous values that are superseded later in
+ * this cycle and write the rest.
+ */
+static void merge_event(midi_merger_t *const mm, void *output_port_buffer,
+                        const jack_midi_event_t *input, int order, jack_nframes_t index) {
+  if (merger_capture_active(&mm->capture)) {
+    capture_event(mm, input, (uint8_t) order);
+  }
+  if (mm->config_in_use->format == FORMAT_UMP) {
+    merge_packet(mm, output_port_buffer, input, order, index);
+    return;
+  }
+
+  count_input(mm, input);
+
+  jack_midi_data_t scratch[3];
+  jack_midi_event_t filtered = *input;
+  const jack_midi_event_t *const event = &filtered;
+  if (!filter_event(&mm->config_in_use->filter, &filtered, scratch)) {
+    ++mm->process_stats.drops[DROP_FILTERED];
+    return;
+  }
+  midi_message_class_t cls;
+  const stage_result_t result = pass_stages(mm, event, order, index, &cls);
+  if (result == STAGE_DROP) {
+    return;
+  }
+
+  if (result == STAGE_HOLD) {
+    hold_throttled(mm, event, cls, order, event);
+    return;
+  }
+  note_state_update(input_notes(mm, order), event->buffer, event->size);
+  write_event(mm, output_port_buffer, event);
+}
+
+
+typedef struct RELEASE_TARGET_T {
+  midi_merger_t *mm;
+  void *output_port_buffer;
+} release_target_t;
+
+
+static void write_release(void *arg, const uint8_t data[3]) {
+  const release_target_t *const target = (const release_target_t *const) arg;
+  if (target->mm->config_in_use->format == FORMAT_UMP) {
+    const uint32_t word = ump_from_midi1(data);
+    const jack_midi_event_t packet = { 0, sizeof(word), (jack_midi_data_t *) &word };
+    write_event(target->mm, target->output_port_buffer, &packet);
+    return;
+  }
+  const jack_midi_event_t event = { 0, 3, (jack_midi_data_t *) data };
+  write_event(target->mm, target->output_port_buffer, &event);
+}
+
+
+/**
+ * End the held notes and pedals of one input.
+ */
+static void release_notes(midi_merger_t *const mm, release_target_t *target,
+                          note_state_t *notes) {
+  const unsigned count = note_state_release(notes, write_release, target);
+  if (count > 0) {
+    ++mm->process_stats.stuck_sources;
+    mm->process_stats.stuck_messages += count;
+  }
+}
+
+
+/**
+ * End the held notes and pedals of sources that are gone, at the
+ * start of the cycle.
+ */
+static void release_sources(midi_merger_t *const mm, void *output_port_buffer) {
+  release_target_t target = { mm, output_port_buffer };
+  const int num_sources = __atomic_load_n(&mm->num_sources, __ATOMIC_ACQUIRE);
+
+  if (__atomic_exchange_n(&mm->in_release, false, __ATOMIC_RELAXED)) {
+    drop_throttled(mm, 0);
+    release_notes(mm, &target, &mm->in_notes);
+  }
+  for (int i = 0; i < num_sources; ++i) {
+    merger_source_t *const source = &mm->sources[i];
+    if (__atomic_exchange_n(&source->release, false, __ATOMIC_RELAXED)) {
+      drop_throttled(mm, i + 1);
+      release_notes(mm, &target, &source->notes);
+    }
+  }
+}
+
+
+/**
+ * Count the time from the registration of a replugged source to its
+ * first event.
+ */
+static void count_replug(merger_process_stats_t *const stats, merger_source_t *const source) {
+  const uint64_t registered_ns = __atomic_exchange_n(&source->replugged_ns, 0, __ATOMIC_RELAXED);
+  const uint64_t latency = now_ns() - registered_ns;
+
+  ++stats->replugs_measured;
+  stats->last_replug_latency_ns = latency;
+  if (latency > stats->max_replug_latency_ns) {
+    stats->max_replug_latency_ns = latency;
+  }
+}
+
+
+/**
+ * K-way merge of `in` and all per-source input ports by event time.
+ * Each input is already sorted, so the heap only holds the next event
+ * of every input.
+ */
+static void merge_sources(midi_merger_t *const mm, void *output_port_buffer,
+                          jack_nframes_t nframes) {
+  merge_cursor_t *const heap = mm->merge_heap;
+  int size = 0;
+
+  add_input(heap, &size, jack_port_get_buffer(mm->ports[PORT_IN], nframes), 0, 0);
+
+  const int num_sources = __atomic_load_n(&mm->num_sources, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < num_sources; ++i) {
+    merger_source_t *const source = &mm->sources[i];
+    void *const buffer = jack_port_get_buffer(source->port, nframes);
+    if (__atomic_load_n(&source->replugged_ns, __ATOMIC_RELAXED) != 0
+        && jack_midi_get_event_count(buffer) > 0) {
+      count_replug(&mm->process_stats, source);
+    }
+    add_input(heap, &size, buffer, __atomic_load_n(&source->priority, __ATOMIC_RELAXED), i + 1);
+  }
+
+  if (mm->config_in_use->coalesce) {
+    for (int i = 0; i < size; ++i) {
+      scan_last_values(mm, heap[i].buffer, heap[i].count, heap[i].priority, heap[i].order);
+    }
+  }
+
+  // Build the heap bottom-up.
+  for (int i = size/2 - 1; i >= 0; --i) {
+    sift_down(heap, size, i);
+  }
+
+  while (size > 0) {
+    merge_cursor_t *const top = &heap[0];
+    merge_event(mm, output_port_buffer, &top->event, top->order, top->index);
+
+    // Advance the input, drop it from the heap when it is exhausted.
+    bool more = false;
+    while (++top->index < top->count) {
+      if (jack_midi_event_get(&top->event, top->buffer, top->index) == 0) {
+        more = true;
+        break;
+      }
+    }
+    if (!more) {
+      heap[0] = heap[--size];
+    }
+    sift_down(heap, size, 0);
+  }
+}
+
+
+int merger_process_callback(jack_nframes_t nframes, void *arg)
+{
+  midi_merger_t *const mm = (midi_merger_t *const) arg;
+  const uint64_t start_ns = now_ns();
+  const uint64_t events_before = mm->process_stats.events_in;
+
+  // Pick up the current configuration for this cycle. The supervisor
+  // frees a replaced one only after it sees that it is not in use, it
+  // is woken up for that.
+  const merger_config_t *const config = __atomic_load_n(&mm->config, __ATOMIC_ACQUIRE);
+  if (config != mm->config_in_use) {
+    __atomic_store_n(&mm->config_in_use, config, __ATOMIC_SEQ_CST);
+    midi_core_wake(mm->core);
+  }
+
+  // Get and clean the output buffer once per cycle.
+  void *output_port_buffer = jack_port_get_buffer(mm->ports[PORT_OUT], nframes);
+  jack_midi_clear_buffer(output_port_buffer);
+
+  if (merger_capture_active(&mm->capture)) {
+    merger_capture_cycle(&mm->capture, mm->frames, nframes);
+  }
+
+  // SysEx first, a partly written message is continued. Carried over
+  // events have to wait until it is complete.
+  mm->sysex_budget_left = (size_t) mm->config_in_use->sysex_budget;
+  if (mm->sysex.count > 0) {
+    drain_sysex(mm, output_port_buffer);
+  }
+  if (mm->spill.count > 0 && !sysex_open(mm)) {
+    flush_spill(mm, output_port_buffer);
+  }
+
+  if (mm->throttle_slots.count > 0) {
+    flush_throttled(mm, output_port_buffer);
+  }
+
+  if (__atomic_load_n(&mm->release_pending, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&mm->release_pending, false, __ATOMIC_RELAXED);
+    release_sources(mm, output_port_buffer);
+  }
+
+  if (mm->config_in_use->per_source) {
+    merge_sources(mm, output_port_buffer, nframes);
+  } else {
+    // Copy events from the input to the output.
+    void *input_port_buffer = jack_port_get_buffer(mm->ports[PORT_IN], nframes);
+    jack_nframes_t event_count = jack_midi_get_event_count(input_port_buffer);
+    if (event_count > 0) {
+
+      if (mm->config_in_use->coalesce) {
+        scan_last_values(mm, input_port_buffer, event_count, 0, 0);
+      }
+
+      jack_midi_event_t in_event;
+      for (jack_nframes_t i = 0; i < event_count; ++i) {
+        const int SUCCESS = 0;
+        if (jack_midi_event_get(&in_event, input_port_buffer, i) == SUCCESS) {
+          merge_event(mm, output_port_buffer, &in_event, 0, i);
+        } else {
+          // ENODATA if buffer is empty. We don't handle this and go on.
+        }
+      }
+    }
+  }
+
+  if (mm->overflow_slots.count > 0) {
+    flush_held_back(mm, output_port_buffer, nframes);
+  }
+  if (mm->coalesce_slots.count > 0) {
+    controller_slots_reset(&mm->coalesce_slots);
+  }
+  if (merger_capture_active(&mm->capture)) {
+    capture_output(mm, output_port_buffer);
+  }
+
+  mm->process_stats.spill_depth = mm->spill.count;
+  if (mm->spill.count > mm->process_stats.max_spill_depth) {
+    mm->process_stats.max_spill_depth = mm->spill.count;
+  }
+  mm->frames += nframes;
+
+  finish_cycle_stats(mm, start_ns, events_before);
+
+  if (mm->wake_supervisor) {
+    mm->wake_supervisor = false;
+    midi_core_wake(mm->core);
+  }
+
+  return 0;
+}
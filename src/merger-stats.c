@@ -0,0 +1,227 @@
+#include "merger-stats.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char *const merger_drop_reason_names[DROP_REASON_COUNT] = {
+  [DROP_NO_BUFFER_SPACE] = "no_buffer_space",
+  [DROP_WRITE_FAILED]    = "write_failed",
+  [DROP_OVERFLOW]        = "overflow",
+  [DROP_SUPERSEDED]      = "superseded",
+  [DROP_SPILL_FULL]      = "spill_full",
+  [DROP_SPILL_EXPIRED]   = "spill_expired",
+  [DROP_COALESCED]       = "coalesced",
+  [DROP_FILTERED]        = "filtered",
+  [DROP_THROTTLED]       = "throttled",
+  [DROP_REDUNDANT_CLOCK] = "redundant_clock",
+  [DROP_REDUNDANT_SENSING] = "redundant_sensing",
+  [DROP_SYSEX_POOL_FULL] = "sysex_pool_full",
+};
+
+
+static void init_stats(merger_stats_t *stats) {
+  // Touch every page now, not in the process callback.
+  memset(stats, 0, sizeof(merger_stats_t));
+  stats->magic = MERGER_STATS_MAGIC;
+  stats->version = MERGER_STATS_VERSION;
+}
+
+
+merger_stats_t *merger_stats_create(const char *name) {
+  merger_stats_t *stats = NULL;
+
+  if (name != NULL) {
+    const int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "Can't create shared memory %s, stats are not exported.\n", name);
+    } else {
+      if (ftruncate(fd, sizeof(merger_stats_t)) == 0) {
+        void *const memory = mmap(NULL, sizeof(merger_stats_t),
+                                  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (memory != MAP_FAILED) {
+          stats = (merger_stats_t *) memory;
+        }
+      }
+      close(fd);
+      if (stats == NULL) {
+        fprintf(stderr, "Can't map shared memory %s, stats are not exported.\n", name);
+        shm_unlink(name);
+      }
+    }
+  }
+
+  if (stats == NULL) {
+    stats = malloc(sizeof(merger_stats_t));
+    if (stats == NULL) {
+      return NULL;
+    }
+  }
+
+  init_stats(stats);
+  return stats;
+}
+
+
+void merger_stats_destroy(merger_stats_t *stats, const char *name) {
+  if (name != NULL) {
+    munmap(stats, sizeof(merger_stats_t));
+    shm_unlink(name);
+  } else {
+    free(stats);
+  }
+}
+
+
+const merger_stats_t *merger_stats_open(const char *name) {
+  const int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  void *memory = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(merger_stats_t)) {
+    memory = mmap(NULL, sizeof(merger_stats_t), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return NULL;
+  }
+
+  const merger_stats_t *const stats = (const merger_stats_t *) memory;
+  if (stats->magic != MERGER_STATS_MAGIC || stats->version != MERGER_STATS_VERSION) {
+    munmap(memory, sizeof(merger_stats_t));
+    return NULL;
+  }
+  return stats;
+}
+
+
+void merger_stats_close(const merger_stats_t *stats) {
+  munmap((void *) stats, sizeof(merger_stats_t));
+}
+
+
+static void write_locked(uint32_t *sequence, void *dest, const void *src, size_t size) {
+  const uint32_t seq = *sequence;
+
+  __atomic_store_n(sequence, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(dest, src, size);
+  __atomic_store_n(sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+static bool read_locked(const uint32_t *sequence, void *dest, const void *src, size_t size) {
+  // Give up eventually, the writer may have died in the middle of an
+  // update.
+  for (int retries = 0; retries < 100000; ++retries) {
+    const uint32_t before = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      continue;
+    }
+    memcpy(dest, src, size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(sequence, __ATOMIC_RELAXED) == before) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void merger_stats_publish_process(merger_stats_t *stats,
+                                  const merger_process_stats_t *process) {
+  write_locked(&stats->process_sequence, &stats->process, process,
+               sizeof(merger_process_stats_t));
+}
+
+
+void merger_stats_publish_connections(merger_stats_t *stats,
+                                      const merger_connection_stats_t *connections) {
+  write_locked(&stats->connection_sequence, &stats->connections, connections,
+               sizeof(merger_connection_stats_t));
+}
+
+
+bool merger_stats_read(const merger_stats_t *stats,
+                       merger_process_stats_t *process,
+                       merger_connection_stats_t *connections) {
+  return read_locked(&stats->process_sequence, process, &stats->process,
+                     sizeof(merger_process_stats_t))
+      && read_locked(&stats->connection_sequence, connections, &stats->connections,
+                     sizeof(merger_connection_stats_t));
+}
+
+
+void merger_stats_print(FILE *file, const merger_process_stats_t *process,
+                        const merger_connection_stats_t *connections,
+                        uint64_t registrations_dropped) {
+  fprintf(file, "cycles %" PRIu64 "\n", process->cycles);
+  fprintf(file, "events_in %" PRIu64 "\n", process->events_in);
+  fprintf(file, "events_out %" PRIu64 "\n", process->events_out);
+  fprintf(file, "bytes_in %" PRIu64 "\n", process->bytes_in);
+  fprintf(file, "bytes_out %" PRIu64 "\n", process->bytes_out);
+  fprintf(file, "max_events_per_cycle %" PRIu64 "\n", process->max_events_per_cycle);
+  for (int i = 0; i < DROP_REASON_COUNT; ++i) {
+    fprintf(file, "drops_%s %" PRIu64 "\n", merger_drop_reason_names[i], process->drops[i]);
+  }
+  fprintf(file, "overflow_protected %" PRIu64 "\n", process->overflow_protected);
+  fprintf(file, "overflow_deferred %" PRIu64 "\n", process->overflow_deferred);
+  fprintf(file, "spilled %" PRIu64 "\n", process->spilled);
+  fprintf(file, "spill_depth %" PRIu64 "\n", process->spill_depth);
+  fprintf(file, "max_spill_depth %" PRIu64 "\n", process->max_spill_depth);
+  for (int i = 0; i < MERGER_STATS_BUCKETS; ++i) {
+    fprintf(file, "process_time_%dus %" PRIu64 "\n", 1 << i, process->process_time[i]);
+  }
+  fprintf(file, "max_process_time_ns %" PRIu64 "\n", process->max_process_time_ns);
+  fprintf(file, "replugs_measured %" PRIu64 "\n", process->replugs_measured);
+  fprintf(file, "last_replug_latency_ns %" PRIu64 "\n", process->last_replug_latency_ns);
+  fprintf(file, "max_replug_latency_ns %" PRIu64 "\n", process->max_replug_latency_ns);
+  fprintf(file, "stuck_sources %" PRIu64 "\n", process->stuck_sources);
+  fprintf(file, "stuck_messages %" PRIu64 "\n", process->stuck_messages);
+  fprintf(file, "throttled_in %" PRIu64 "\n", process->throttled[0]);
+  for (int i = 1; i < MERGER_STATS_INPUTS; ++i) {
+    if (process->throttled[i] > 0) {
+      fprintf(file, "throttled_in_%d %" PRIu64 "\n", i, process->throttled[i]);
+    }
+  }
+  if (process->clock_master == 0) {
+    fprintf(file, "clock_master none\n");
+  } else if (process->clock_master == 1) {
+    fprintf(file, "clock_master in\n");
+  } else {
+    fprintf(file, "clock_master in_%" PRIu64 "\n", process->clock_master - 1);
+  }
+  fprintf(file, "clock_elections %" PRIu64 "\n", process->clock_elections);
+  fprintf(file, "clock_failovers %" PRIu64 "\n", process->clock_failovers);
+  fprintf(file, "sysex_chunks %" PRIu64 "\n", process->sysex_chunks);
+  fprintf(file, "sysex_segmented %" PRIu64 "\n", process->sysex_segmented);
+  fprintf(file, "sysex_held %" PRIu64 "\n", process->sysex_held);
+  fprintf(file, "captured %" PRIu64 "\n", process->captured);
+  fprintf(file, "capture_lost %" PRIu64 "\n", process->capture_lost);
+
+  fprintf(file, "connections_scheduled %" PRIu64 "\n", connections->scheduled);
+  fprintf(file, "connections_connected %" PRIu64 "\n", connections->connected);
+  fprintf(file, "connections_existing %" PRIu64 "\n", connections->existing);
+  fprintf(file, "connections_failed %" PRIu64 "\n", connections->failed);
+  fprintf(file, "connection_batches %" PRIu64 "\n", connections->batches);
+  fprintf(file, "connection_duplicates %" PRIu64 "\n", connections->duplicates);
+  fprintf(file, "connection_rescans %" PRIu64 "\n", connections->rescans);
+  fprintf(file, "storms %" PRIu64 "\n", connections->storms);
+  fprintf(file, "last_storm_ports %" PRIu64 "\n", connections->last_storm_ports);
+  fprintf(file, "last_convergence_ns %" PRIu64 "\n", connections->last_convergence_ns);
+  fprintf(file, "max_convergence_ns %" PRIu64 "\n", connections->max_convergence_ns);
+  fprintf(file, "port_cache_hits %" PRIu64 "\n", connections->cache_hits);
+  fprintf(file, "unplugs %" PRIu64 "\n", connections->unplugs);
+  fprintf(file, "replugs %" PRIu64 "\n", connections->replugs);
+  fprintf(file, "duplicates_suppressed %" PRIu64 "\n", connections->duplicates_suppressed);
+  fprintf(file, "takeovers %" PRIu64 "\n", connections->takeovers);
+  fprintf(file, "registrations_dropped %" PRIu64 "\n", registrations_dropped);
+}
@@ -0,0 +1,195 @@
+#ifndef MERGER_STATS_H
+#define MERGER_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* layout version of the shared memory segment */
+#define MERGER_STATS_MAGIC 0x4d4d5354
+#define MERGER_STATS_VERSION 13
+
+/* process time histogram, bucket `i` counts cycles of [2^i, 2^(i+1)) µs,
+   bucket 0 includes anything shorter */
+#define MERGER_STATS_BUCKETS 16
+
+/* inputs with their own counters, `in` and the per-source inputs */
+#define MERGER_STATS_INPUTS 65
+
+/* longest shared memory name, including the terminator */
+#define MERGER_STATS_NAME_SIZE 64
+
+typedef enum MERGER_DROP_REASON {
+    DROP_NO_BUFFER_SPACE,
+    DROP_WRITE_FAILED,
+    DROP_OVERFLOW,
+    DROP_SUPERSEDED,
+    DROP_SPILL_FULL,
+    DROP_SPILL_EXPIRED,
+    DROP_COALESCED,
+    DROP_FILTERED,
+    DROP_THROTTLED,
+    DROP_REDUNDANT_CLOCK,
+    DROP_REDUNDANT_SENSING,
+    DROP_SYSEX_POOL_FULL,
+    DROP_REASON_COUNT // this is not used as a reason
+} merger_drop_reason_t;
+
+extern const char *const merger_drop_reason_names[DROP_REASON_COUNT];
+
+/**
+ * Counters of the process callback. Only the realtime thread writes
+ * them.
+ */
+typedef struct MERGER_PROCESS_STATS_T {
+  uint64_t cycles;
+  uint64_t events_in;
+  uint64_t events_out;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t max_events_per_cycle;
+  uint64_t drops[DROP_REASON_COUNT];
+  // Decisions of the overflow policy: protected events written into
+  // the headroom, latest controller values written at the cycle end.
+  uint64_t overflow_protected;
+  uint64_t overflow_deferred;
+  // Events carried over to the next cycle, and the queue depth in
+  // events at the end of the last cycle.
+  uint64_t spilled;
+  uint64_t spill_depth;
+  uint64_t max_spill_depth;
+  uint64_t process_time[MERGER_STATS_BUCKETS];
+  uint64_t max_process_time_ns;
+  // Time from the registration of a replugged source to its first
+  // event, per-source inputs only.
+  uint64_t replugs_measured;
+  uint64_t last_replug_latency_ns;
+  uint64_t max_replug_latency_ns;
+  // Sources that were unplugged with notes or pedals held, and the
+  // Note Offs and pedal releases written for them.
+  uint64_t stuck_sources;
+  uint64_t stuck_messages;
+  // Events over the rate limit per input, `in` first, then `in_<n>`.
+  uint64_t throttled[MERGER_STATS_INPUTS];
+  // Input of the clock master plus one, 0 if there is none, how often
+  // one was elected and how often because the last one went silent.
+  uint64_t clock_master;
+  uint64_t clock_elections;
+  uint64_t clock_failovers;
+  // SysEx chunks written from the pool, messages that took more than
+  // one, and events held back while a message was partly written.
+  uint64_t sysex_chunks;
+  uint64_t sysex_segmented;
+  uint64_t sysex_held;
+  // Events recorded with `capture=`, and the ones lost because the
+  // ring was full.
+  uint64_t captured;
+  uint64_t capture_lost;
+} merger_process_stats_t;
+
+/**
+ * Counters of the connection supervisor. Only the supervisor thread
+ * writes them.
+ */
+typedef struct MERGER_CONNECTION_STATS_T {
+  uint64_t scheduled;
+  uint64_t connected;
+  uint64_t existing;
+  uint64_t failed;
+  // Batches taken from the queue, ids that were queued more than once
+  // and full rescans after the queue overflowed.
+  uint64_t batches;
+  uint64_t duplicates;
+  uint64_t rescans;
+  // Bursts of registrations, from the first one until everything is
+  // connected, and the ports handled in the last one.
+  uint64_t storms;
+  uint64_t last_storm_ports;
+  uint64_t last_convergence_ns;
+  uint64_t max_convergence_ns;
+  // Registrations of ports seen before by name, ports that went away
+  // and came back, recognized by name or alias.
+  uint64_t cache_hits;
+  uint64_t unplugs;
+  uint64_t replugs;
+  // Ports not connected because another port of the same device is,
+  // and ports connected when that one went away.
+  uint64_t duplicates_suppressed;
+  uint64_t takeovers;
+} merger_connection_stats_t;
+
+/**
+ * The shared memory segment. Each group of counters has one writer
+ * and is protected by its own sequence lock: the writer makes the
+ * sequence odd while it updates, readers retry until they see the same
+ * even sequence before and after copying.
+ */
+typedef struct MERGER_STATS_T {
+  uint32_t magic;
+  uint32_t version;
+
+  uint32_t process_sequence;
+  merger_process_stats_t process;
+
+  uint32_t connection_sequence;
+  merger_connection_stats_t connections;
+
+  // Updated atomically by the port registration callback. They are
+  // recovered by a rescan.
+  uint64_t registrations_dropped;
+} merger_stats_t;
+
+/**
+ * Create and map the segment `name`, or map private memory if `name`
+ * is NULL or the segment can't be created. Returns NULL if out of
+ * memory.
+ */
+merger_stats_t *merger_stats_create(const char *name);
+
+void merger_stats_destroy(merger_stats_t *stats, const char *name);
+
+/**
+ * Map the segment `name` read-only. Returns NULL on failure.
+ */
+const merger_stats_t *merger_stats_open(const char *name);
+
+void merger_stats_close(const merger_stats_t *stats);
+
+/**
+ * Copy the counters into the segment. They are wait-free for the
+ * single writer of each group.
+ */
+void merger_stats_publish_process(merger_stats_t *stats,
+                                  const merger_process_stats_t *process);
+
+void merger_stats_publish_connections(merger_stats_t *stats,
+                                      const merger_connection_stats_t *connections);
+
+/**
+ * Take a consistent snapshot of the counters. Returns false if no
+ * consistent snapshot could be taken.
+ */
+bool merger_stats_read(const merger_stats_t *stats,
+                       merger_process_stats_t *process,
+                       merger_connection_stats_t *connections);
+
+/**
+ * Print the counters as `key value` lines.
+ */
+void merger_stats_print(FILE *file, const merger_process_stats_t *process,
+                        const merger_connection_stats_t *connections,
+                        uint64_t registrations_dropped);
+
+/**
+ * Return the histogram bucket for a process time.
+ */
+static inline int merger_stats_bucket(uint64_t ns) {
+  const uint64_t us = ns / 1000;
+  if (us < 2) {
+    return 0;
+  }
+  const int bucket = 63 - __builtin_clzll(us);
+  return bucket < MERGER_STATS_BUCKETS ? bucket : MERGER_STATS_BUCKETS - 1;
+}
+
+#endif
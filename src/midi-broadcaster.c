@@ -1,226 +1,206 @@
 #include "midi-broadcaster.h"
 
-#include <unistd.h>
-
 /* port flags to connect to */
 static const int target_port_flags = JackPortIsTerminal|JackPortIsPhysical|JackPortIsInput;
 
 /**
- * Add a port_id to the waiting queue.
- * It is a producer in the realtime context.
+ * Connect our output to a destination port.
  */
-size_t push_back(jack_ringbuffer_t *queue, jack_port_id_t port_id) {
-  size_t written = 0;
-
-  if (queue == NULL) {
-    fprintf(stderr, "Could not schedule port connection.\n");
-  } else {
-
-    // Check if there is space to write
-    size_t write_space = jack_ringbuffer_write_space(queue);
-    if (write_space >= sizeof(jack_port_id_t)) {
-      written = jack_ringbuffer_write(queue,
-                                      (const char*)&port_id,
-                                      sizeof(jack_port_id_t));
-      if (written < sizeof(jack_port_id_t)) {
-        fprintf(stderr, "Could not schedule port connection.\n");
-      }
+static int connect_destination(void *arg, const char *destination_name,
+                               port_role_state_t *state) {
+  midi_broadcaster_t *const mm = (midi_broadcaster_t *const) arg;
+  jack_port_t *output = mm->ports[BROADCASTER_OUT];
+
+  // The first matching route wins.
+  for (int i = 0; i < mm->num_routes; ++i) {
+    if (strstr(destination_name, mm->route_patterns[i]) != NULL) {
+      output = mm->route_ports[i];
+      break;
     }
   }
-  return written;
+
+  // Checking locally saves a server round trip for known ports.
+  if (jack_port_connected_to(output, destination_name)) {
+    return EEXIST;
+  }
+  return jack_connect(mm->client, jack_port_name(output), destination_name);
 }
 
 
 /**
- * Return the next port_id or NULL if empty.
+ * Copy the events of `in` to `out`. Both buffers have the same size,
+ * so everything fits.
  */
-jack_port_id_t next(jack_ringbuffer_t *queue) {
-  size_t read = 0;
-  jack_port_id_t id = 0;
-
-  if (queue == NULL) {
-    fprintf(stderr, "Queue memory problem.\n");
-  } else {
-    char buffer[sizeof(jack_port_id_t)];
-    read = jack_ringbuffer_read(queue, buffer, sizeof(jack_port_id_t));
-    if (read == sizeof(jack_port_id_t)) {
-      id = (jack_port_id_t) *buffer;
+static void copy_events(void *in, void *out) {
+  jack_midi_clear_buffer(out);
+
+  const uint32_t count = jack_midi_get_event_count(in);
+  for (uint32_t i = 0; i < count; ++i) {
+    jack_midi_event_t event;
+    if (jack_midi_event_get(&event, in, i) == 0) {
+      jack_midi_event_write(out, event.time, event.buffer, event.size);
     }
   }
-  return id;
 }
 
+
 /**
- * Connect any outstanding Jack ports.
- * It is a consumer in the non-realtime context.
+ * Write the events of `in` to the route outputs, looking up the
+ * outputs of an event by its status byte.
  */
-void handle_scheduled_connections(midi_broadcaster_t *const mm) {
-  // Check if there are connections scheduled.
-  jack_port_id_t source;
-
-  while ((source = next(mm->ports_to_connect)) != 0) {
-    int result;
-    result = jack_connect(mm->client,
-                          jack_port_name(mm->ports[PORT_OUT]) ,
-                          jack_port_name(jack_port_by_id(mm->client, source)));
-    switch(result) {
-    case 0:
-      // Fine.
-      break;
-    case EEXIST:
-      fprintf(stderr, "Connection exists.\n");
-      break;
-    default:
-      fprintf(stderr, "Could not connect port.\n");
-      break;
-    }
+static void route_events(midi_broadcaster_t *const mm, void *in, jack_nframes_t nframes) {
+  void *outputs[MERGER_MAX_ROUTES];
+  for (int i = 0; i < mm->num_routes; ++i) {
+    outputs[i] = jack_port_get_buffer(mm->route_ports[i], nframes);
+    jack_midi_clear_buffer(outputs[i]);
   }
-}
 
-
-static int process_callback(jack_nframes_t nframes, void *arg)
-{
-  // nothing here, `jack_port_tie` takes care of buffer zero-copy
-  return 0;
+  const uint32_t count = jack_midi_get_event_count(in);
+  for (uint32_t i = 0; i < count; ++i) {
+    jack_midi_event_t event;
+    if (jack_midi_event_get(&event, in, i) != 0 || event.size == 0) {
+      continue;
+    }
+    for (unsigned int mask = mm->route_masks[event.buffer[0]]; mask != 0; mask &= mask - 1) {
+      jack_midi_event_write(outputs[__builtin_ctz(mask)], event.time, event.buffer, event.size);
+    }
+  }
 }
 
 
-static void port_registration_callback(jack_port_id_t port_id, int is_registered, void *arg)
-{
+static int broadcaster_process(jack_nframes_t nframes, void *arg) {
   midi_broadcaster_t *const mm = (midi_broadcaster_t *const) arg;
+  void *const in = jack_port_get_buffer(mm->ports[BROADCASTER_IN], nframes);
+  void *const out = jack_port_get_buffer(mm->ports[BROADCASTER_OUT], nframes);
+
+  // The buffers alias if the tie is in effect. Jack may hand out other
+  // buffers after a graph change, so this is checked every cycle.
+  const broadcaster_path_t path = mm->tied && out == in
+                                ? BROADCASTER_PATH_TIE : BROADCASTER_PATH_COPY;
+  if (path != mm->path) {
+    __atomic_store_n(&mm->path, path, __ATOMIC_RELEASE);
+    midi_core_wake(mm->core);
+  }
 
-  // If there is a new port of type MIDI input we connect it to our
-  // output port.
-  if (is_registered) {
-    jack_port_t *source = jack_port_by_id(mm->client, port_id);
-    // Check if MIDI input
-    if ((jack_port_flags(source) & target_port_flags) == target_port_flags) {
-      const char *const ptype = jack_port_type(source);
-      if (ptype && strcmp(ptype, JACK_DEFAULT_MIDI_TYPE) == 0) {
-
-        // We can't call jack_connect here in the callback,
-        // Schedule the connection for later.
-        push_back(mm->ports_to_connect, port_id);
-        sem_post(&mm->sem);
-      }
-    }
+  if (path == BROADCASTER_PATH_COPY) {
+    copy_events(in, out);
   }
-  return;
+  if (mm->num_routes > 0) {
+    route_events(mm, in, nframes);
+  }
+  return 0;
 }
 
 
 /**
- * `Supervise` handles the non-realtime port connections.
+ * Report how the events get to the output, when it changes.
  */
-void *supervise(void *arg) {
+static bool poll_broadcaster(void *arg) {
   midi_broadcaster_t *const mm = (midi_broadcaster_t *const) arg;
+  const broadcaster_path_t path = __atomic_load_n(&mm->path, __ATOMIC_ACQUIRE);
 
-  while (mm->do_exit == false) {
-    handle_scheduled_connections(mm);
-    sem_wait(&mm->sem);
+  if (path != mm->reported_path) {
+    switch (path) {
+    case BROADCASTER_PATH_UNKNOWN:
+      break;
+    case BROADCASTER_PATH_TIE:
+      fprintf(stderr, "Broadcaster path: port tie, the output port shares the input buffer.\n");
+      break;
+    case BROADCASTER_PATH_COPY:
+      fprintf(stderr, "Broadcaster path: copy, %s.\n",
+              mm->tied ? "the output port doesn't share the input buffer"
+                       : "the port tie failed");
+      break;
+    }
+    mm->reported_path = path;
   }
-  return NULL;
+  return false;
 }
 
-int jack_initialize(jack_client_t* client, const char* load_init)
+
+midi_broadcaster_t *broadcaster_create(midi_core_t *core, const char *prefix,
+                                       const merger_config_t *config)
 {
-  midi_broadcaster_t *const mm = malloc(sizeof(midi_broadcaster_t));
+  midi_broadcaster_t *const mm = midi_core_alloc(core, sizeof(midi_broadcaster_t));
   if (!mm) {
     fprintf(stderr, "Out of memory\n");
-    return EXIT_FAILURE;
+    return NULL;
   }
 
-  mm->client = client;
+  mm->core = core;
+  mm->client = core->client;
+  mm->num_routes = 0;
 
   // Register ports.
-  mm->ports[PORT_IN] = jack_port_register(client, "in",
-                                          JACK_DEFAULT_MIDI_TYPE,
-                                          JackPortIsInput, 0);
-  mm->ports[PORT_OUT] = jack_port_register(client, "out",
-                                           JACK_DEFAULT_MIDI_TYPE,
-                                           JackPortIsOutput, 0);
-  for (int i = 0; i < PORT_ARRAY_SIZE; ++i) {
+  char port_name[32];
+  snprintf(port_name, sizeof(port_name), "%sin", prefix);
+  mm->ports[BROADCASTER_IN] = jack_port_register(mm->client, port_name,
+                                                 JACK_DEFAULT_MIDI_TYPE,
+                                                 JackPortIsInput, 0);
+  snprintf(port_name, sizeof(port_name), "%sout", prefix);
+  mm->ports[BROADCASTER_OUT] = jack_port_register(mm->client, port_name,
+                                                  JACK_DEFAULT_MIDI_TYPE,
+                                                  JackPortIsOutput, 0);
+  for (int i = 0; i < BROADCASTER_PORT_COUNT; ++i) {
     if (!mm->ports[i]) {
       fprintf(stderr, "Can't register jack port\n");
-      free(mm);
-      return EXIT_FAILURE;
+      broadcaster_destroy(mm);
+      return NULL;
     }
   }
 
-  jack_port_tie(mm->ports[PORT_IN], mm->ports[PORT_OUT]);
-
-  // Set port aliases
-  jack_port_set_alias(mm->ports[PORT_IN], "MIDI in");
-  jack_port_set_alias(mm->ports[PORT_OUT], "MIDI out");
-
-  // Create the ringbuffer (single-producer/single-consumer) for
-  // scheduled port connections. It contains elements of type
-  // `jack_port_id_t`.
-  mm->ports_to_connect = jack_ringbuffer_create(queue_size);
-
-  // Set callbacks
-  jack_set_process_callback(client, process_callback, mm);
-  jack_set_port_registration_callback(client, port_registration_callback, mm);
-
-  // Init the connection supervisor worker thread
-  sem_init(&mm->sem, 0, 0);
-  mm->do_exit = false;
-  int rc = pthread_create(&(mm->connection_supervisor), NULL, &supervise, mm);
-  if (rc != 0) {
-    fprintf(stderr, "Can't create worker thread\n");
-    return EXIT_FAILURE;
-  }
-
-  /* Activate the jack client */
-  if (jack_activate(client) != 0) {
-    fprintf(stderr, "can't activate jack client\n");
-    free(mm);
-    return EXIT_FAILURE;
-  }
-
-  const char **const ports = jack_get_ports(client, "", JACK_DEFAULT_MIDI_TYPE, target_port_flags);
-  if (ports != NULL)
-  {
-    char  aliases[2][320];
-    char* aliasesptr[2] = { aliases[0], aliases[1] };
-    const char* const ourportname = jack_port_name(mm->ports[PORT_OUT]);
-
-    for (int i=0; ports[i] != NULL; ++i) {
-      if (strncmp(ports[i], "system_midi:Midi Through", 24) == 0)
-        continue;
-
-      if (strncmp(ports[i], "system:midi_playback_", 21) == 0 || strncmp(ports[i], "system_midi:playback_", 21) == 0) {
-        if (jack_port_get_aliases(jack_port_by_name(client, ports[i]), aliasesptr) > 0) {
-          if (strncmp(aliases[0], "alsa_pcm:Midi-Through/", 22) == 0) {
-            continue;
-          }
-        }
-      }
-      jack_connect(client, ourportname, ports[i]);
+  for (int i = 0; i < config->num_routes; ++i) {
+    snprintf(port_name, sizeof(port_name), "%sout_%d", prefix, i + 1);
+    mm->route_ports[i] = jack_port_register(mm->client, port_name,
+                                            JACK_DEFAULT_MIDI_TYPE,
+                                            JackPortIsOutput, 0);
+    if (!mm->route_ports[i]) {
+      fprintf(stderr, "Can't register jack port\n");
+      broadcaster_destroy(mm);
+      return NULL;
     }
+    strcpy(mm->route_patterns[i], config->route_patterns[i]);
+    ++mm->num_routes;
 
-    jack_free(ports);
+    char alias[32];
+    snprintf(alias, sizeof(alias), "MIDI out %d", i + 1);
+    jack_port_set_alias(mm->route_ports[i], alias);
   }
+  memcpy(mm->route_masks, config->route_masks, sizeof(mm->route_masks));
 
-  return 0;
+  // With `jack_port_tie` there is nothing to do in the process
+  // callback, if it works.
+  mm->tied = jack_port_tie(mm->ports[BROADCASTER_IN], mm->ports[BROADCASTER_OUT]) == 0;
+  mm->path = BROADCASTER_PATH_UNKNOWN;
+  mm->reported_path = BROADCASTER_PATH_UNKNOWN;
+
+  // Set port aliases
+  jack_port_set_alias(mm->ports[BROADCASTER_IN], "MIDI in");
+  jack_port_set_alias(mm->ports[BROADCASTER_OUT], "MIDI out");
+
+  const midi_role_t role = {
+    .target_flags = target_port_flags,
+    .connect = connect_destination,
+    .disconnect = NULL,
+    .process = broadcaster_process,
+    .poll = poll_broadcaster,
+    .arg = mm,
+  };
+  midi_core_add_role(core, &role);
+
+  return mm;
 }
 
 
-void jack_finish(void* arg)
+void broadcaster_destroy(midi_broadcaster_t *mm)
 {
-  midi_broadcaster_t *const mm = (midi_broadcaster_t *const) arg;
-
-  jack_deactivate(mm->client);
-
-  for (int i = 0; i < PORT_ARRAY_SIZE; ++i) {
-    jack_port_unregister(mm->client, mm->ports[i]);
+  for (int i = 0; i < BROADCASTER_PORT_COUNT; ++i) {
+    if (mm->ports[i]) {
+      jack_port_unregister(mm->client, mm->ports[i]);
+    }
   }
-
-  mm->do_exit = true;
-  sem_post(&mm->sem);
-  pthread_join(mm->connection_supervisor, NULL);
-  sem_destroy(&mm->sem);
-  jack_ringbuffer_free(mm->ports_to_connect);
-
-  free(mm);
+  for (int i = 0; i < mm->num_routes; ++i) {
+    jack_port_unregister(mm->client, mm->route_ports[i]);
+  }
+  midi_core_free(mm->core, mm);
 }
@@ -7,38 +7,59 @@
 #include <string.h>
 #include <jack/jack.h>
 #include <jack/midiport.h>
-#include <jack/ringbuffer.h>
-#include <pthread.h>
 #include <stdbool.h>
 
-#include "mod-semaphore.h"
+#include "midi-core.h"
+#include "merger-config.h"
 
-enum Ports {
-    PORT_IN,
-    PORT_OUT,
-    PORT_ARRAY_SIZE // this is not used as a port index
+enum BroadcasterPorts {
+    BROADCASTER_IN,
+    BROADCASTER_OUT,
+    BROADCASTER_PORT_COUNT // this is not used as a port index
 };
 
-static const size_t queue_size = 64*sizeof(jack_port_id_t);
+typedef enum BROADCASTER_PATH {
+    // Not decided before the first cycle.
+    BROADCASTER_PATH_UNKNOWN,
+    // `out` was handed the buffer of `in`, nothing to copy.
+    BROADCASTER_PATH_TIE,
+    // The events are copied in the process callback.
+    BROADCASTER_PATH_COPY
+} broadcaster_path_t;
 
 typedef struct MIDI_BROADCASTER_T {
+  midi_core_t *core;
   jack_client_t *client;
-  jack_port_t *ports[PORT_ARRAY_SIZE];
-  jack_ringbuffer_t *ports_to_connect;
+  jack_port_t *ports[BROADCASTER_PORT_COUNT];
 
-  bool do_exit;
-  pthread_t connection_supervisor;
-  sem_t sem;
+  // Jack accepted the port tie. Jack2 does, but ignores it. No event
+  // is sent through the tie to test it: every cycle the process
+  // callback only checks whether `out` got the buffer of `in`, sets
+  // `path` from that and copies if not. The supervisor reports the
+  // path in use when it changes.
+  bool tied;
+  broadcaster_path_t path;
+  broadcaster_path_t reported_path;
+
+  // Outputs of the `route=` rules, `out_<n>`. A destination matching
+  // a pattern is connected to its output instead of `out`.
+  int num_routes;
+  jack_port_t *route_ports[MERGER_MAX_ROUTES];
+  char route_patterns[MERGER_MAX_ROUTES][MERGER_PATTERN_SIZE];
+  uint16_t route_masks[256];
 } midi_broadcaster_t;
 
 /**
- * For use as a Jack-internal client, `jack_initialize()` and
- * `jack_finish()` have to be exported in the shared library.
+ * Set up the broadcaster with its ports, `<prefix>in`, `<prefix>out`
+ * and an output per `route=` pattern of `config`, and add it to the
+ * roles of `core`. Returns NULL on failure.
  */
-JACK_LIB_EXPORT
-int jack_initialize(jack_client_t* client, const char* load_init);
+midi_broadcaster_t *broadcaster_create(midi_core_t *core, const char *prefix,
+                                       const merger_config_t *config);
 
-JACK_LIB_EXPORT
-void jack_finish(void* arg);
+/**
+ * Unregister the ports and free the broadcaster, after the core stopped.
+ */
+void broadcaster_destroy(midi_broadcaster_t *mm);
 
 #endif
@@ -0,0 +1,225 @@
+#include "midi-client.h"
+#include "midi-core.h"
+#include "midi-merger.h"
+#include "midi-broadcaster.h"
+
+/*
+ * Entry points of the internal clients. All libraries host the same
+ * roles, `MIDI_CLIENT_DEFAULT_MODE` is the one used without `mode=`.
+ */
+#ifndef MIDI_CLIENT_DEFAULT_MODE
+#define MIDI_CLIENT_DEFAULT_MODE CLIENT_MODE_MERGER
+#endif
+
+struct MIDI_CLIENT_T {
+  // Jack passes the argument of the process callback, the core, to
+  // `jack_finish()`, so it has to come first.
+  midi_core_t core;
+  midi_merger_t *merger;
+  midi_broadcaster_t *broadcaster;
+  // With `memory=locked` everything is allocated from here, the
+  // client itself included.
+  rt_arena_t arena;
+};
+
+
+/**
+ * Memory for the client and its roles.
+ */
+static size_t arena_size(const merger_config_t *config) {
+  return sizeof(midi_client_t) + 2 * sizeof(merger_config_t) + sizeof(midi_merger_t)
+       + sizeof(midi_broadcaster_t) + sizeof(port_cache_t)
+       + spill_queue_memory((size_t) config->spill)
+       + spill_queue_memory((size_t) config->sysex_pool)
+       + merger_capture_memory(config->capture_path[0] != '\0' ? (size_t) config->capture_size : 0)
+       + 8 * RT_ARENA_ALIGN;
+}
+
+
+/**
+ * Allocate the client. With `memory=locked` it goes into a new arena
+ * and `config` is moved there.
+ */
+static midi_client_t *new_client(merger_config_t **config) {
+  if (!(*config)->locked_memory) {
+    return calloc(1, sizeof(midi_client_t));
+  }
+
+  rt_arena_t arena;
+  if (rt_arena_init(&arena, arena_size(*config)) != 0) {
+    return NULL;
+  }
+  midi_client_t *const mc = rt_arena_alloc(&arena, sizeof(midi_client_t));
+  merger_config_t *const copy = rt_arena_alloc(&arena, sizeof(merger_config_t));
+  memcpy(copy, *config, sizeof(merger_config_t));
+  free(*config);
+  *config = copy;
+  mc->arena = arena;
+  return mc;
+}
+
+
+void midi_client_free(midi_client_t *mc) {
+  if (mc->merger) {
+    merger_destroy(mc->merger);
+  }
+  if (mc->broadcaster) {
+    broadcaster_destroy(mc->broadcaster);
+  }
+  if (mc->core.arena != NULL) {
+    // The arena holds the client, unmap it through a copy.
+    rt_arena_t arena = mc->arena;
+    rt_arena_free(&arena);
+  } else {
+    free(mc);
+  }
+}
+
+
+static int check_region(const rt_arena_t *arena, const char *name,
+                        const void *start, size_t size) {
+  if (size == 0 || rt_arena_contains(arena, start, size)) {
+    return 0;
+  }
+  fprintf(stderr, "The %s is not in the locked memory.\n", name);
+  return 1;
+}
+
+
+/**
+ * The self-check of `memory=locked`: report the state of the process
+ * callback that could still take a page fault.
+ */
+static void check_memory(const midi_client_t *const mc) {
+  const rt_arena_t *const arena = &mc->arena;
+  int unsafe = 0;
+
+  if (arena->lock_error != 0) {
+    fprintf(stderr, "Can't lock %zu bytes of memory: %s, raise the memlock limit.\n",
+            arena->size, strerror(arena->lock_error));
+    ++unsafe;
+  }
+
+  unsafe += check_region(arena, "client", mc, sizeof(midi_client_t));
+  const midi_merger_t *const mm = mc->merger;
+  if (mm) {
+    unsafe += check_region(arena, "merger", mm, sizeof(midi_merger_t));
+    unsafe += check_region(arena, "configuration", mm->config, sizeof(merger_config_t));
+    unsafe += check_region(arena, "spill queue", mm->spill.data, mm->spill.data_size);
+    unsafe += check_region(arena, "SysEx pool", mm->sysex.data, mm->sysex.data_size);
+    unsafe += check_region(arena, "capture ring", mm->capture.ring, mm->capture.size);
+    if (!mm->stats_locked) {
+      fprintf(stderr, "Can't lock the stats.\n");
+      ++unsafe;
+    }
+  }
+  if (mc->broadcaster) {
+    unsafe += check_region(arena, "broadcaster", mc->broadcaster, sizeof(midi_broadcaster_t));
+  }
+
+  const size_t missing = rt_memory_missing_pages(arena->base, arena->used);
+  if (missing > 0) {
+    fprintf(stderr, "%zu pages of the locked memory are not in memory.\n", missing);
+    ++unsafe;
+  }
+
+  if (unsafe == 0) {
+    fprintf(stderr, "Memory locked, %zu of %zu bytes in use.\n", arena->used, arena->size);
+  }
+}
+
+
+midi_client_t *midi_client_create(jack_client_t *client, const char *options) {
+  merger_config_t *config = malloc(sizeof(merger_config_t));
+  if (!config) {
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+
+  merger_config_init(config);
+  if (merger_config_parse(config, options) != 0) {
+    fprintf(stderr, "Invalid options: %s\n", options);
+    free(config);
+    return NULL;
+  }
+
+  midi_client_t *const mc = new_client(&config);
+  if (!mc) {
+    fprintf(stderr, "Out of memory\n");
+    free(config);
+    return NULL;
+  }
+
+  const merger_client_mode_t mode = config->mode != CLIENT_MODE_DEFAULT
+                                  ? config->mode : MIDI_CLIENT_DEFAULT_MODE;
+  const bool locked_memory = config->locked_memory;
+
+  midi_core_init(&mc->core, client);
+  if (locked_memory) {
+    mc->core.arena = &mc->arena;
+  }
+  mc->core.supervisor_policy = config->supervisor_policy;
+  mc->core.supervisor_priority = config->supervisor_priority;
+  mc->core.supervisor_cpus = config->supervisor_cpus;
+
+  if (mode == CLIENT_MODE_BROADCASTER || mode == CLIENT_MODE_BOTH) {
+    // Next to the merger the ports need other names.
+    mc->broadcaster = broadcaster_create(&mc->core, mode == CLIENT_MODE_BOTH ? "broadcast_" : "",
+                                         config);
+    if (!mc->broadcaster) {
+      midi_core_free(&mc->core, config);
+      midi_client_free(mc);
+      return NULL;
+    }
+  }
+
+  if (mode == CLIENT_MODE_MERGER || mode == CLIENT_MODE_BOTH) {
+    // The merger takes the configuration.
+    mc->merger = merger_create(&mc->core, config);
+    if (!mc->merger) {
+      midi_client_free(mc);
+      return NULL;
+    }
+  } else {
+    midi_core_free(&mc->core, config);
+  }
+
+  if (midi_core_start(&mc->core) != 0) {
+    midi_client_free(mc);
+    return NULL;
+  }
+
+  if (locked_memory) {
+    check_memory(mc);
+  }
+  return mc;
+}
+
+
+void midi_client_stop(midi_client_t *mc) {
+  midi_core_stop(&mc->core);
+}
+
+
+void midi_client_print_stats(const midi_client_t *mc, FILE *file) {
+  const midi_merger_t *const mm = mc->merger;
+  if (mm) {
+    merger_stats_print(file, &mm->process_stats, &mc->core.connection_stats,
+                       __atomic_load_n(&mc->core.registrations_dropped, __ATOMIC_RELAXED));
+  }
+}
+
+
+int jack_initialize(jack_client_t* client, const char* load_init)
+{
+  return midi_client_create(client, load_init) ? 0 : EXIT_FAILURE;
+}
+
+
+void jack_finish(void* arg)
+{
+  midi_client_t *const mc = (midi_client_t *const) arg;
+
+  midi_client_stop(mc);
+  midi_client_free(mc);
+}
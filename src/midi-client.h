@@ -0,0 +1,33 @@
+#ifndef MIDI_CLIENT_H
+#define MIDI_CLIENT_H
+
+#include <stdio.h>
+#include <jack/jack.h>
+
+/**
+ * A client with its roles, what `jack_initialize()` creates and
+ * `jack_finish()` gets back. The standalone clients use these directly
+ * to own its lifetime.
+ */
+typedef struct MIDI_CLIENT_T midi_client_t;
+
+/**
+ * Create the roles for `options` and activate `client`. Returns NULL
+ * on failure.
+ */
+midi_client_t *midi_client_create(jack_client_t *client, const char *options);
+
+/**
+ * Deactivate the client and stop the supervisor.
+ */
+void midi_client_stop(midi_client_t *mc);
+
+/**
+ * Print the counters of a stopped client as `key value` lines, nothing
+ * without a merger.
+ */
+void midi_client_print_stats(const midi_client_t *mc, FILE *file);
+
+void midi_client_free(midi_client_t *mc);
+
+#endif
@@ -0,0 +1,538 @@
+#define _GNU_SOURCE
+#include "midi-core.h"
+
+#include <inttypes.h>
+#include <sched.h>
+#include <unistd.h>
+
+/**
+ * Queue a port event for the supervisor.
+ * It is a producer in the realtime context, errors go to `log`.
+ */
+static bool push_back(rt_log_t *log, port_queue_t *queue, jack_port_id_t port_id,
+                      uint32_t flags, port_event_kind_t kind, uint64_t time_ns) {
+  if (!port_queue_push(queue, port_id, flags, kind, time_ns)) {
+    rt_log(log, LOG_QUEUE_FULL, (int32_t) port_id, 0);
+    return false;
+  }
+  return true;
+}
+
+
+static inline bool role_wants(const midi_role_t *role, int flags) {
+  return (flags & role->target_flags) == role->target_flags;
+}
+
+
+/**
+ * Connect a port to every role that wants it and count the results.
+ */
+static void connect_port(midi_core_t *const core, const char *port_name, int flags,
+                         port_role_state_t states[MIDI_CORE_MAX_ROLES]) {
+  merger_connection_stats_t *const stats = &core->connection_stats;
+
+  for (int i = 0; i < core->num_roles; ++i) {
+    const midi_role_t *const role = &core->roles[i];
+    if (!role_wants(role, flags)) {
+      continue;
+    }
+
+    switch(role->connect(role->arg, port_name, &states[i])) {
+    case 0:
+      // Fine.
+      ++stats->connected;
+      break;
+    case EEXIST:
+      ++stats->existing;
+      break;
+    default:
+      fprintf(stderr, "Could not connect port %s.\n", port_name);
+      ++stats->failed;
+      break;
+    }
+    states[i].replugged_ns = 0;
+  }
+}
+
+
+/**
+ * Forget that a port is there. If it was the connected port of a
+ * device, another port of the same device takes over.
+ */
+static void mark_unplugged(midi_core_t *const core, known_port_t *known) {
+  known->present = false;
+  port_cache_set_id(core->known_ports, known, -1);
+  ++core->connection_stats.unplugs;
+
+  if (known->ignored || known->suppressed) {
+    return;
+  }
+
+  for (int i = 0; i < core->num_roles; ++i) {
+    const midi_role_t *const role = &core->roles[i];
+    if (role->disconnect) {
+      role->disconnect(role->arg, known->name, &known->roles[i]);
+    }
+  }
+
+  known_port_t *const standby = port_cache_find_device(core->known_ports, known->identity,
+                                                       known, true);
+  if (standby) {
+    ++core->connection_stats.takeovers;
+    standby->suppressed = false;
+    connect_port(core, standby->name, standby->flags, standby->roles);
+  }
+}
+
+
+/**
+ * Look for ports that are gone without the supervisor knowing their
+ * id: all of them after registrations were lost, otherwise the ones
+ * found by a scan.
+ */
+static void forget_missing_ports(midi_core_t *const core, bool all) {
+  port_cache_t *const cache = core->known_ports;
+
+  for (int i = 0; i < cache->count; ++i) {
+    known_port_t *const known = &cache->ports[i];
+    if (known->present && (all || known->id < 0)
+        && jack_port_by_name(core->client, known->name) == NULL) {
+      mark_unplugged(core, known);
+    }
+  }
+}
+
+
+/**
+ * Find a port in the cache by name, or by alias if it got another
+ * name, or add it. Only new ports are checked for being Midi-Through.
+ * Returns NULL if the cache is full.
+ */
+static known_port_t *learn_port(midi_core_t *const core, jack_port_t *port,
+                                const char *port_name, int flags, bool *is_new) {
+  port_cache_t *const cache = core->known_ports;
+
+  *is_new = false;
+  known_port_t *known = port_cache_find(cache, port_name);
+  if (known) {
+    ++core->connection_stats.cache_hits;
+    return known;
+  }
+
+  char  aliases[2][PORT_CACHE_NAME_SIZE];
+  char* aliasesptr[2] = { aliases[0], aliases[1] };
+  if (jack_port_get_aliases(port, aliasesptr) <= 0) {
+    aliases[0][0] = '\0';
+  }
+
+  known = port_cache_find_alias(cache, aliases[0]);
+  if (known) {
+    port_cache_rename(cache, known, port_name);
+    return known;
+  }
+
+  char identity[PORT_IDENTITY_SIZE];
+  if (!port_device_identity(port_name, aliases[0], flags, identity, sizeof(identity))) {
+    identity[0] = '\0';
+  }
+
+  known = port_cache_add(cache, port_name, aliases[0], identity);
+  if (known) {
+    known->ignored = port_is_midi_through(core->client, port_name);
+    *is_new = true;
+  }
+  return known;
+}
+
+
+/**
+ * Connect a registered port, restoring what the roles had for it if it
+ * was unplugged before. `id` is -1 for ports found by a scan.
+ */
+static void port_seen(midi_core_t *const core, jack_port_t *port, const char *port_name,
+                      int flags, int32_t id, uint64_t time_ns) {
+  bool is_new;
+  known_port_t *const known = learn_port(core, port, port_name, flags, &is_new);
+
+  if (known == NULL) {
+    // Cache full, connect without remembering anything.
+    port_role_state_t states[MIDI_CORE_MAX_ROLES];
+    for (int i = 0; i < MIDI_CORE_MAX_ROLES; ++i) {
+      states[i].slot = -1;
+      states[i].replugged_ns = 0;
+    }
+    if (!port_is_midi_through(core->client, port_name)) {
+      connect_port(core, port_name, flags, states);
+    }
+    return;
+  }
+
+  // The id now belongs to this port, whatever had it is gone.
+  known_port_t *const previous = port_cache_find_id(core->known_ports, id);
+  if (previous && previous != known) {
+    mark_unplugged(core, previous);
+  }
+
+  if (!is_new && !known->present) {
+    ++core->connection_stats.replugs;
+    for (int i = 0; i < MIDI_CORE_MAX_ROLES; ++i) {
+      known->roles[i].replugged_ns = time_ns;
+    }
+  }
+  if (id >= 0 || !known->present) {
+    port_cache_set_id(core->known_ports, known, id);
+  }
+  known->flags = flags;
+
+  // Only one port per device, e.g. not both the ALSA and the a2j port.
+  if (!known->present || known->suppressed) {
+    known->suppressed = port_cache_find_device(core->known_ports, known->identity,
+                                               known, false) != NULL;
+    if (known->suppressed) {
+      ++core->connection_stats.duplicates_suppressed;
+    }
+  }
+  known->present = true;
+
+  if (!known->ignored && !known->suppressed) {
+    connect_port(core, port_name, flags, known->roles);
+  }
+}
+
+
+/**
+ * Connect all ports the roles want. It is used at the start and when
+ * registrations were lost because the queue was full.
+ * Returns the number of ports.
+ */
+static uint64_t scan_ports(midi_core_t *const core) {
+  uint64_t count = 0;
+  const uint64_t now = port_batch_now_ns();
+
+  for (int i = 0; i < core->num_roles; ++i) {
+    const midi_role_t *const role = &core->roles[i];
+    const char **const ports = jack_get_ports(core->client, "", JACK_DEFAULT_MIDI_TYPE,
+                                              (unsigned long) role->target_flags);
+    if (ports == NULL) {
+      continue;
+    }
+
+    for (int j = 0; ports[j] != NULL; ++j) {
+      jack_port_t *const port = jack_port_by_name(core->client, ports[j]);
+      if (port) {
+        port_seen(core, port, ports[j], role->target_flags, -1, now);
+        ++count;
+      }
+    }
+    jack_free(ports);
+  }
+  return count;
+}
+
+
+/**
+ * Connect any outstanding Jack ports. Registrations are taken from the
+ * queue in batches without duplicates, if any were lost all ports are
+ * scanned again. A storm of registrations is over once the queue is
+ * empty, its duration is counted from the first registration.
+ * It is a consumer in the non-realtime context.
+ */
+static void handle_scheduled_connections(midi_core_t *const core) {
+  merger_connection_stats_t *const stats = &core->connection_stats;
+  port_batch_t batch;
+  bool handled = false;
+  bool rescanned = false;
+  const uint64_t start_ns = port_batch_now_ns();
+
+  while (port_batch_drain(&batch, &core->ports_to_connect) > 0) {
+    ++stats->batches;
+    stats->duplicates += batch.duplicates;
+
+    // Ports that are gone first, so a device that was replugged within
+    // the batch is recognized.
+    for (size_t i = 0; i < batch.count; ++i) {
+      const port_event_t *const event = &batch.events[i];
+      if (event->kind != PORT_UNREGISTERED) {
+        continue;
+      }
+      known_port_t *const known = port_cache_find_id(core->known_ports, (int32_t) event->id);
+      if (known) {
+        mark_unplugged(core, known);
+      } else {
+        // Not one of ours, or one whose id isn't known.
+        forget_missing_ports(core, false);
+      }
+    }
+
+    for (size_t i = 0; i < batch.count; ++i) {
+      const port_event_t *const event = &batch.events[i];
+      if (event->kind != PORT_REGISTERED) {
+        continue;
+      }
+      jack_port_t *const port = jack_port_by_id(core->client, event->id);
+      ++stats->scheduled;
+      if (port == NULL) {
+        // Gone again.
+        ++stats->failed;
+        continue;
+      }
+      port_seen(core, port, jack_port_name(port), (int) event->flags,
+                (int32_t) event->id, event->time_ns);
+    }
+    core->storm_ports += batch.count;
+    handled = true;
+  }
+
+  if (__atomic_exchange_n(&core->rescan, false, __ATOMIC_ACQ_REL)) {
+    ++stats->rescans;
+    forget_missing_ports(core, true);
+    core->storm_ports += scan_ports(core);
+    handled = rescanned = true;
+  }
+
+  if (handled && port_queue_empty(&core->ports_to_connect)) {
+    uint64_t first_ns = __atomic_exchange_n(&core->storm_start_ns, 0, __ATOMIC_ACQ_REL);
+    if (first_ns == 0 || first_ns > start_ns) {
+      first_ns = start_ns;
+    }
+    const uint64_t elapsed = port_batch_now_ns() - first_ns;
+
+    ++stats->storms;
+    stats->last_storm_ports = core->storm_ports;
+    stats->last_convergence_ns = elapsed;
+    if (elapsed > stats->max_convergence_ns) {
+      stats->max_convergence_ns = elapsed;
+    }
+    if (core->storm_ports > 1 || rescanned) {
+      fprintf(stderr, "Handled %" PRIu64 " port registrations in %.1f ms.\n",
+              core->storm_ports, (double) elapsed / 1000000.0);
+    }
+    core->storm_ports = 0;
+  }
+}
+
+
+static int process_callback(jack_nframes_t nframes, void *arg)
+{
+  midi_core_t *const core = (midi_core_t *const) arg;
+
+  for (int i = 0; i < core->num_roles; ++i) {
+    const midi_role_t *const role = &core->roles[i];
+    if (role->process) {
+      role->process(nframes, role->arg);
+    }
+  }
+  return 0;
+}
+
+
+static void port_registration_callback(jack_port_id_t port_id, int is_registered, void *arg)
+{
+  midi_core_t *const core = (midi_core_t *const) arg;
+  const uint64_t now = port_batch_now_ns();
+
+  if (!is_registered) {
+    // The port is gone already, the supervisor knows whether it was
+    // one of ours.
+    if (!push_back(&core->log, &core->ports_to_connect, port_id, 0, PORT_UNREGISTERED, now)) {
+      __atomic_fetch_add(&core->registrations_dropped, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&core->rescan, true, __ATOMIC_RELEASE);
+    }
+    sem_post(&core->sem);
+    return;
+  }
+
+  // If there is a new MIDI port one of the roles wants, we connect it.
+  jack_port_t *port = jack_port_by_id(core->client, port_id);
+  const int flags = jack_port_flags(port);
+
+  bool wanted = false;
+  for (int i = 0; i < core->num_roles; ++i) {
+    wanted = wanted || role_wants(&core->roles[i], flags);
+  }
+
+  if (wanted) {
+    const char *const ptype = jack_port_type(port);
+    if (ptype && strcmp(ptype, JACK_DEFAULT_MIDI_TYPE) == 0) {
+
+      // We can't call jack_connect here in the callback,
+      // Schedule the connection for later.
+      uint64_t none = 0;
+      __atomic_compare_exchange_n(&core->storm_start_ns, &none, now, false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      if (!push_back(&core->log, &core->ports_to_connect, port_id, (uint32_t) flags,
+                     PORT_REGISTERED, now)) {
+        // Not lost, the supervisor looks at all ports again.
+        __atomic_fetch_add(&core->registrations_dropped, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&core->rescan, true, __ATOMIC_RELEASE);
+      }
+      sem_post(&core->sem);
+    }
+  }
+}
+
+
+/**
+ * `Supervise` handles the non-realtime port connections and whatever
+ * else the roles do outside the process callback.
+ */
+static void *supervise(void *arg) {
+  midi_core_t *const core = (midi_core_t *const) arg;
+
+  while (core->do_exit == false) {
+    handle_scheduled_connections(core);
+
+    bool again = false;
+    for (int i = 0; i < core->num_roles; ++i) {
+      const midi_role_t *const role = &core->roles[i];
+      if (role->poll && role->poll(role->arg)) {
+        again = true;
+      }
+    }
+
+    // Wake up again when summaries of repeated messages are due, or
+    // when a role asks for it.
+    if (rt_log_flush(&core->log, stderr) || again) {
+      sem_timedwait_secs(&core->sem, 1);
+    } else {
+      sem_wait(&core->sem);
+    }
+  }
+  rt_log_flush(&core->log, stderr);
+  return NULL;
+}
+
+
+void midi_core_init(midi_core_t *core, jack_client_t *client) {
+  core->client = client;
+  core->arena = NULL;
+  core->num_roles = 0;
+  port_queue_init(&core->ports_to_connect);
+  core->known_ports = NULL;
+  core->rescan = false;
+  core->storm_start_ns = 0;
+  core->storm_ports = 0;
+  memset(&core->connection_stats, 0, sizeof(merger_connection_stats_t));
+  core->registrations_dropped = 0;
+  rt_log_init(&core->log);
+  core->do_exit = false;
+  sem_init(&core->sem, 0, 0);
+  core->supervisor_policy = SUPERVISOR_INHERIT;
+  core->supervisor_priority = 0;
+  core->supervisor_cpus = 0;
+}
+
+
+void *midi_core_alloc(midi_core_t *core, size_t size) {
+  if (core->arena != NULL) {
+    return rt_arena_alloc(core->arena, size);
+  }
+  return calloc(1, size);
+}
+
+
+void midi_core_free(midi_core_t *core, void *memory) {
+  if (core->arena == NULL || !rt_arena_contains(core->arena, memory, 0)) {
+    free(memory);
+  }
+}
+
+
+int midi_core_add_role(midi_core_t *core, const midi_role_t *role) {
+  if (core->num_roles == MIDI_CORE_MAX_ROLES) {
+    return -1;
+  }
+  core->roles[core->num_roles++] = *role;
+  return 0;
+}
+
+
+/**
+ * Start the supervisor thread with the configured scheduling. If that
+ * is not permitted it starts with the defaults.
+ */
+static int start_supervisor(midi_core_t *core) {
+  static const int policies[] = {
+    [SUPERVISOR_INHERIT] = SCHED_OTHER,
+    [SUPERVISOR_OTHER]   = SCHED_OTHER,
+    [SUPERVISOR_BATCH]   = SCHED_BATCH,
+    [SUPERVISOR_IDLE]    = SCHED_IDLE,
+    [SUPERVISOR_FIFO]    = SCHED_FIFO,
+    [SUPERVISOR_RR]      = SCHED_RR,
+  };
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (core->supervisor_policy != SUPERVISOR_INHERIT) {
+    const struct sched_param param = { .sched_priority = core->supervisor_priority };
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, policies[core->supervisor_policy]);
+    pthread_attr_setschedparam(&attr, &param);
+  }
+  if (core->supervisor_cpus != 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < 64; ++cpu) {
+      if (core->supervisor_cpus & (1ull << cpu)) {
+        CPU_SET(cpu, &cpus);
+      }
+    }
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  }
+
+  int rc = pthread_create(&core->supervisor, &attr, &supervise, core);
+  pthread_attr_destroy(&attr);
+  if (rc == EPERM || rc == EINVAL) {
+    fprintf(stderr, "Can't set the scheduling of the supervisor: %s, using the defaults.\n",
+            strerror(rc));
+    rc = pthread_create(&core->supervisor, NULL, &supervise, core);
+  }
+  return rc;
+}
+
+
+int midi_core_start(midi_core_t *core) {
+  core->known_ports = midi_core_alloc(core, sizeof(port_cache_t));
+  if (!core->known_ports) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  port_cache_init(core->known_ports);
+
+  // Set callbacks
+  jack_set_process_callback(core->client, process_callback, core);
+  jack_set_port_registration_callback(core->client, port_registration_callback, core);
+
+  /* Activate the jack client */
+  if (jack_activate(core->client) != 0) {
+    fprintf(stderr, "can't activate jack client\n");
+    midi_core_free(core, core->known_ports);
+    core->known_ports = NULL;
+    return -1;
+  }
+
+  // Connect the ports there are before the supervisor starts, it
+  // picks up the registrations queued in the meantime.
+  scan_ports(core);
+
+  if (start_supervisor(core) != 0) {
+    fprintf(stderr, "Can't create worker thread\n");
+    jack_deactivate(core->client);
+    midi_core_free(core, core->known_ports);
+    core->known_ports = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+void midi_core_stop(midi_core_t *core) {
+  jack_deactivate(core->client);
+
+  core->do_exit = true;
+  sem_post(&core->sem);
+  pthread_join(core->supervisor, NULL);
+  sem_destroy(&core->sem);
+  midi_core_free(core, core->known_ports);
+  core->known_ports = NULL;
+}
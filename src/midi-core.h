@@ -0,0 +1,145 @@
+#ifndef MIDI_CORE_H
+#define MIDI_CORE_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <jack/jack.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "mod-semaphore.h"
+#include "rt-arena.h"
+#include "rt-log.h"
+#include "merger-config.h"
+#include "merger-stats.h"
+#include "port-batch.h"
+#include "port-cache.h"
+#include "port-queue.h"
+
+/* most roles hosted by one client */
+#define MIDI_CORE_MAX_ROLES PORT_CACHE_ROLES
+
+/**
+ * What a client does, e.g. merging or broadcasting. The core calls
+ * these hooks, `arg` is passed to all of them.
+ */
+typedef struct MIDI_ROLE_T {
+  // Ports with all of these flags are connected to the role.
+  int target_flags;
+
+  // Connect a port, returns 0, EEXIST or another error. `state` is
+  // what the role kept for the port, from before it was unplugged.
+  // It is called by the supervisor thread.
+  int (*connect)(void *arg, const char *port_name, port_role_state_t *state);
+
+  // A connected port is gone, may be NULL. It is called by the
+  // supervisor thread.
+  void (*disconnect)(void *arg, const char *port_name, port_role_state_t *state);
+
+  // Part of the process callback, may be NULL.
+  int (*process)(jack_nframes_t nframes, void *arg);
+
+  // Called on every wakeup of the supervisor, may be NULL. Returns
+  // true to be called again within a second.
+  bool (*poll)(void *arg);
+
+  void *arg;
+} midi_role_t;
+
+/**
+ * The parts every client needs: the port registration callback, the
+ * queue of registered ports and the supervisor thread that connects
+ * them, and the log of the realtime callbacks. One client hosts one
+ * or more roles with a single process callback and supervisor.
+ */
+typedef struct MIDI_CORE_T {
+  jack_client_t *client;
+
+  // The locked memory the state is allocated from, NULL unless
+  // `memory=locked`.
+  rt_arena_t *arena;
+
+  midi_role_t roles[MIDI_CORE_MAX_ROLES];
+  int num_roles;
+
+  port_queue_t ports_to_connect;
+
+  // Ports seen so far, allocated by `midi_core_start()`. Replugged
+  // devices are recognized by name or alias.
+  port_cache_t *known_ports;
+
+  // Set when a registration didn't fit into `ports_to_connect`, the
+  // supervisor then scans all ports. `storm_start_ns` is the time of
+  // the first registration the supervisor hasn't caught up with.
+  bool rescan;
+  uint64_t storm_start_ns;
+  uint64_t storm_ports;
+
+  // Written by the supervisor, `registrations_dropped` atomically by
+  // the registration callback.
+  merger_connection_stats_t connection_stats;
+  uint64_t registrations_dropped;
+
+  // Messages from the realtime callbacks, printed by the supervisor.
+  rt_log_t log;
+
+  bool do_exit;
+  pthread_t supervisor;
+  sem_t sem;
+  // Scheduling of the supervisor, set before `midi_core_start()`.
+  merger_supervisor_policy_t supervisor_policy;
+  int supervisor_priority;
+  uint64_t supervisor_cpus;
+} midi_core_t;
+
+void midi_core_init(midi_core_t *core, jack_client_t *client);
+
+/**
+ * Allocate zeroed memory for the state of a role, from the arena if
+ * there is one. Returns NULL if out of memory.
+ */
+void *midi_core_alloc(midi_core_t *core, size_t size);
+
+/**
+ * Free memory from `midi_core_alloc()`. Arena memory stays until the
+ * arena is unmapped.
+ */
+void midi_core_free(midi_core_t *core, void *memory);
+
+/**
+ * Add a role. Returns -1 if there is no room for it.
+ */
+int midi_core_add_role(midi_core_t *core, const midi_role_t *role);
+
+/**
+ * Set the callbacks, activate the client, connect the ports there are
+ * and start the supervisor. Returns 0 on success.
+ */
+int midi_core_start(midi_core_t *core);
+
+/**
+ * Deactivate the client and stop the supervisor.
+ */
+void midi_core_stop(midi_core_t *core);
+
+/**
+ * For use as a Jack-internal client, `jack_initialize()` and
+ * `jack_finish()` have to be exported in the shared library.
+ */
+JACK_LIB_EXPORT
+int jack_initialize(jack_client_t* client, const char* load_init);
+
+JACK_LIB_EXPORT
+void jack_finish(void* arg);
+
+/**
+ * Wake up the supervisor. It is safe to call from the realtime
+ * context.
+ */
+static inline void midi_core_wake(midi_core_t *core) {
+  sem_post(&core->sem);
+}
+
+#endif
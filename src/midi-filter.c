@@ -0,0 +1,221 @@
+#include "midi-filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* all 16 channels */
+#define ALL_CHANNELS 0xffff
+
+typedef struct MESSAGE_TYPE_T {
+  const char *name;
+  // Channel messages have a type nibble and match channels, system
+  // messages cover the status bytes from `first` to `last`.
+  uint8_t first;
+  uint8_t last;
+  bool channel;
+} message_type_t;
+
+static const message_type_t message_types[] = {
+  { "note",             0x80, 0x90, true },
+  { "poly-pressure",    0xa0, 0xa0, true },
+  { "cc",               0xb0, 0xb0, true },
+  { "program",          0xc0, 0xc0, true },
+  { "channel-pressure", 0xd0, 0xd0, true },
+  { "pitch-bend",       0xe0, 0xe0, true },
+  { "sysex",            0xf0, 0xf0, false },
+  { "common",           0xf1, 0xf7, false },
+  { "clock",            0xf8, 0xf8, false },
+  { "start",            0xfa, 0xfa, false },
+  { "continue",         0xfb, 0xfb, false },
+  { "stop",             0xfc, 0xfc, false },
+  { "active-sensing",   0xfe, 0xfe, false },
+  { "reset",            0xff, 0xff, false },
+  { "realtime",         0xf8, 0xff, false },
+  { "all",              0x80, 0xff, false },
+};
+
+
+/**
+ * Parse a channel list like `1-4,10` into a bit mask.
+ */
+static int parse_channels(const char *spec, uint16_t *mask) {
+  *mask = 0;
+
+  while (*spec != '\0') {
+    char *end;
+    const long first = strtol(spec, &end, 10);
+    long last = first;
+    if (end == spec) {
+      return -1;
+    }
+    if (*end == '-') {
+      spec = end + 1;
+      last = strtol(spec, &end, 10);
+      if (end == spec) {
+        return -1;
+      }
+    }
+    if (first < 1 || last > 16 || first > last) {
+      return -1;
+    }
+    for (long channel = first; channel <= last; ++channel) {
+      *mask |= (uint16_t) (1 << (channel - 1));
+    }
+
+    if (*end == ',') {
+      ++end;
+    } else if (*end != '\0') {
+      return -1;
+    }
+    spec = end;
+  }
+  return *mask != 0 ? 0 : -1;
+}
+
+
+/**
+ * Split `<value>[@<channels>]`, `value` receives the first part.
+ */
+static int split_channels(const char *spec, char *value, size_t value_size,
+                          uint16_t *mask) {
+  const char *const at = strchr(spec, '@');
+  const size_t length = at ? (size_t) (at - spec) : strlen(spec);
+
+  if (length == 0 || length >= value_size) {
+    return -1;
+  }
+  memcpy(value, spec, length);
+  value[length] = '\0';
+
+  if (at == NULL) {
+    *mask = ALL_CHANNELS;
+    return 0;
+  }
+  return parse_channels(at + 1, mask);
+}
+
+
+/**
+ * Derive the lookup tables from the rules.
+ */
+static void compile(midi_filter_t *filter) {
+  for (int status = 0; status < 256; ++status) {
+    uint8_t action = filter->drop[status] ? 0 : FILTER_PASS;
+    uint8_t mapped = (uint8_t) status;
+
+    if (status >= 0x80 && status < 0xf0) {
+      const int channel = status & 0x0f;
+      const int type = status & 0xf0;
+
+      mapped = (uint8_t) (type | filter->channel_map[channel]);
+      if (mapped != status) {
+        action |= FILTER_REMAP;
+      }
+      if (filter->transpose[channel] != 0 && type <= 0xa0) {
+        action |= FILTER_TRANSPOSE;
+      }
+    }
+
+    filter->action[status] = action;
+    filter->status_map[status] = mapped;
+  }
+}
+
+
+void midi_filter_init(midi_filter_t *filter) {
+  memset(filter, 0, sizeof(midi_filter_t));
+  for (int channel = 0; channel < 16; ++channel) {
+    filter->channel_map[channel] = (uint8_t) channel;
+  }
+  compile(filter);
+}
+
+
+int midi_filter_parse_types(const char *spec, bool statuses[256]) {
+  char types[128];
+  uint16_t channels;
+
+  if (split_channels(spec, types, sizeof(types), &channels) != 0) {
+    return -1;
+  }
+
+  for (char *type = strtok(types, ","); type != NULL; type = strtok(NULL, ",")) {
+    const message_type_t *match = NULL;
+    for (size_t i = 0; i < sizeof(message_types) / sizeof(message_types[0]); ++i) {
+      if (strcmp(type, message_types[i].name) == 0) {
+        match = &message_types[i];
+        break;
+      }
+    }
+    if (match == NULL) {
+      return -1;
+    }
+
+    // Channel types name the type nibbles, they cover all channels.
+    const int last = match->channel ? (match->last | 0x0f) : match->last;
+    for (int status = match->first; status <= last; ++status) {
+      // Channels only apply to channel messages, also within `all`.
+      if (status >= 0xf0 || (channels & (1 << (status & 0x0f)))) {
+        statuses[status] = true;
+      }
+    }
+  }
+  return 0;
+}
+
+
+int midi_filter_add_drop(midi_filter_t *filter, const char *spec) {
+  // Collect first, a bad type leaves the filter as it was.
+  bool drop[256] = { false };
+  if (midi_filter_parse_types(spec, drop) != 0) {
+    return -1;
+  }
+
+  for (int status = 0; status < 256; ++status) {
+    filter->drop[status] = filter->drop[status] || drop[status];
+  }
+  compile(filter);
+  return 0;
+}
+
+
+int midi_filter_add_remap(midi_filter_t *filter, const char *spec) {
+  char *end;
+  const long from = strtol(spec, &end, 10);
+  if (end == spec || *end != ':') {
+    return -1;
+  }
+  const char *const to_spec = end + 1;
+  const long to = strtol(to_spec, &end, 10);
+  if (end == to_spec || *end != '\0' || from < 1 || from > 16 || to < 1 || to > 16) {
+    return -1;
+  }
+
+  filter->channel_map[from - 1] = (uint8_t) (to - 1);
+  compile(filter);
+  return 0;
+}
+
+
+int midi_filter_add_transpose(midi_filter_t *filter, const char *spec) {
+  char value[16];
+  uint16_t channels;
+
+  if (split_channels(spec, value, sizeof(value), &channels) != 0) {
+    return -1;
+  }
+
+  char *end;
+  const long semitones = strtol(value, &end, 10);
+  if (end == value || *end != '\0' || semitones < -127 || semitones > 127) {
+    return -1;
+  }
+
+  for (int channel = 0; channel < 16; ++channel) {
+    if (channels & (1 << channel)) {
+      filter->transpose[channel] = (int8_t) semitones;
+    }
+  }
+  compile(filter);
+  return 0;
+}
@@ -0,0 +1,93 @@
+#ifndef MIDI_FILTER_H
+#define MIDI_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* actions per status byte */
+#define FILTER_PASS      0x01
+#define FILTER_REMAP     0x02
+#define FILTER_TRANSPOSE 0x04
+
+/**
+ * Filter and remap rules compiled into lookup tables. Per event it
+ * costs one table lookup, events that pass unchanged take no other
+ * work.
+ *
+ * Rules are
+ *   `filter=<types>[@<channels>]`  drop messages of these types
+ *   `remap=<channel>:<channel>`    move a channel to another one
+ *   `transpose=<semitones>[@<channels>]`  shift notes and poly pressure
+ * where types are a comma separated list of `note`, `poly-pressure`,
+ * `cc`, `program`, `channel-pressure`, `pitch-bend`, `sysex`,
+ * `common`, `clock`, `start`, `continue`, `stop`, `active-sensing`,
+ * `reset`, `realtime` or `all`, and channels a list like `1-4,10`.
+ * Filters and transposition match the channel before remapping.
+ */
+typedef struct MIDI_FILTER_T {
+  uint8_t action[256];
+  uint8_t status_map[256];
+  int8_t transpose[16];
+
+  // The rules, the tables above are derived from them.
+  uint8_t channel_map[16];
+  bool drop[256];
+} midi_filter_t;
+
+/**
+ * Set up a filter that passes everything unchanged.
+ */
+void midi_filter_init(midi_filter_t *filter);
+
+/**
+ * Add a rule, `spec` is the part after the `=`. Return 0 on success.
+ */
+int midi_filter_add_drop(midi_filter_t *filter, const char *spec);
+int midi_filter_add_remap(midi_filter_t *filter, const char *spec);
+int midi_filter_add_transpose(midi_filter_t *filter, const char *spec);
+
+/**
+ * Mark the status bytes of the messages in `<types>[@<channels>]`
+ * in `statuses`. Return 0 on success.
+ */
+int midi_filter_parse_types(const char *spec, bool statuses[256]);
+
+/**
+ * Apply the filter to one message. Returns NULL if it is dropped,
+ * otherwise `data` or `scratch` holding the rewritten message.
+ * It is safe to call from the realtime context.
+ */
+static inline const uint8_t *midi_filter_apply(const midi_filter_t *filter,
+                                               const uint8_t *data, size_t size,
+                                               uint8_t scratch[3]) {
+  if (size == 0) {
+    return data;
+  }
+
+  const uint8_t status = data[0];
+  const uint8_t action = filter->action[status];
+
+  if (action == FILTER_PASS) {
+    return data;
+  }
+  if (!(action & FILTER_PASS) || size > 3) {
+    // Rewritten messages are channel messages of up to 3 bytes.
+    return (action & FILTER_PASS) ? data : NULL;
+  }
+
+  scratch[0] = filter->status_map[status];
+  scratch[1] = size > 1 ? data[1] : 0;
+  scratch[2] = size > 2 ? data[2] : 0;
+
+  if ((action & FILTER_TRANSPOSE) && size > 1) {
+    const int note = scratch[1] + filter->transpose[status & 0x0f];
+    if (note < 0 || note > 127) {
+      return NULL;
+    }
+    scratch[1] = (uint8_t) note;
+  }
+  return scratch;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#include "merger-stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Print the counters of a running merger as `key value` lines, e.g.
+ *
+ *   $ mod-midi-merger-stats /mod-midi-merger
+ *
+ * The argument is the segment name, or the client name it is exported
+ * under by default. Without one the default client is read.
+ */
+int main(int argc, char **argv) {
+  const char *const arg = argc > 1 ? argv[1] : "mod-midi-merger";
+  char name[MERGER_STATS_NAME_SIZE];
+
+  // The same name the merger exports the counters under.
+  if (arg[0] == '/') {
+    snprintf(name, sizeof(name), "%s", arg);
+  } else {
+    snprintf(name, sizeof(name), "/%s", arg);
+    for (char *c = name + 1; *c != '\0'; ++c) {
+      if (*c == '/') {
+        *c = '_';
+      }
+    }
+  }
+
+  const merger_stats_t *const stats = merger_stats_open(name);
+  if (stats == NULL) {
+    fprintf(stderr, "Can't open stats %s.\n", name);
+    return EXIT_FAILURE;
+  }
+
+  merger_process_stats_t process;
+  merger_connection_stats_t connections;
+  if (!merger_stats_read(stats, &process, &connections)) {
+    fprintf(stderr, "Stats %s are not consistent.\n", name);
+    merger_stats_close(stats);
+    return EXIT_FAILURE;
+  }
+
+  merger_stats_print(stdout, &process, &connections,
+                     __atomic_load_n(&stats->registrations_dropped, __ATOMIC_RELAXED));
+
+  merger_stats_close(stats);
+  return EXIT_SUCCESS;
+}
@@ -1,185 +1,408 @@
 #include "midi-merger.h"
 
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 /* port flags to connect to */
 static const int target_port_flags = JackPortIsTerminal|JackPortIsPhysical|JackPortIsOutput;
 
+
 /**
- * Add a port_id to the waiting queue.
- * It is a producer in the realtime context.
+ * Give a source its own input port and connect it. A replugged source
+ * gets the port it had before if that is still free, so it keeps its
+ * settings. Otherwise an input port that lost its source is reused
+ * before a new one is registered. The slot is taken under
+ * `sources_lock`, the server is only asked to connect after it is
+ * released.
+ * It is called in the non-realtime context only.
  */
-size_t push_back(jack_ringbuffer_t *queue, jack_port_id_t port_id) {
-  size_t written = 0;
+static int attach_source(midi_merger_t *const mm, const char *source_name,
+                         port_role_state_t *state) {
+  int result = 0;
+  merger_source_t *slot = NULL;
+
+  pthread_mutex_lock(&mm->sources_lock);
+
+  for (int i = 0; i < mm->num_sources; ++i) {
+    merger_source_t *const source = &mm->sources[i];
+    if (jack_port_connected_to(source->port, source_name)) {
+      state->slot = i;
+      pthread_mutex_unlock(&mm->sources_lock);
+      return EEXIST;
+    }
+    if (!source->attaching && jack_port_connected(source->port) == 0
+        && (slot == NULL || i == state->slot)) {
+      slot = source;
+    }
+  }
 
-  if (queue == NULL) {
-    fprintf(stderr, "Could not schedule port connection.\n");
-  } else {
+  if (slot == NULL) {
+    if (mm->num_sources == MAX_SOURCES) {
+      fprintf(stderr, "Too many sources, %s not connected.\n", source_name);
+      pthread_mutex_unlock(&mm->sources_lock);
+      return ENOSPC;
+    }
 
-    // Check if there is space to write
-    size_t write_space = jack_ringbuffer_write_space(queue);
-    if (write_space >= sizeof(jack_port_id_t)) {
-      written = jack_ringbuffer_write(queue,
-                                      (const char*)&port_id,
-                                      sizeof(jack_port_id_t));
-      if (written < sizeof(jack_port_id_t)) {
-        fprintf(stderr, "Could not schedule port connection.\n");
-      }
+    char port_name[16];
+    snprintf(port_name, sizeof(port_name), "in_%d", mm->num_sources + 1);
+    jack_port_t *const port = jack_port_register(mm->client, port_name,
+                                                 JACK_DEFAULT_MIDI_TYPE,
+                                                 JackPortIsInput | mm->port_flags, 0);
+    if (!port) {
+      fprintf(stderr, "Can't register jack port\n");
+      pthread_mutex_unlock(&mm->sources_lock);
+      return ENOMEM;
     }
+
+    slot = &mm->sources[mm->num_sources];
+    slot->port = port;
+    slot->priority = 0;
+    slot->replugged_ns = 0;
+    note_state_init(&slot->notes);
+    slot->release = false;
+    slot->attaching = false;
+    // Publish the slot to the process callback.
+    __atomic_store_n(&mm->num_sources, mm->num_sources + 1, __ATOMIC_RELEASE);
   }
-  return written;
+
+  state->slot = (int) (slot - mm->sources);
+  __atomic_store_n(&slot->priority,
+                   merger_config_priority(mm->config, source_name),
+                   __ATOMIC_RELAXED);
+  // The process callback measures the time to the first event.
+  __atomic_store_n(&slot->replugged_ns, state->replugged_ns, __ATOMIC_RELAXED);
+  // Nobody else takes the slot until it is connected.
+  slot->attaching = true;
+  pthread_mutex_unlock(&mm->sources_lock);
+
+  result = jack_connect(mm->client, source_name, jack_port_name(slot->port));
+
+  pthread_mutex_lock(&mm->sources_lock);
+  slot->attaching = false;
+  pthread_mutex_unlock(&mm->sources_lock);
+  return result;
 }
 
 
 /**
- * Return the next port_id or NULL if empty.
+ * Connect a source port to the merger, either to `in` or to a port
+ * of its own.
  */
-jack_port_id_t next(jack_ringbuffer_t *queue) {
-  size_t read = 0;
-  jack_port_id_t id = 0;
+static int connect_source(void *arg, const char *source_name, port_role_state_t *state) {
+  midi_merger_t *const mm = (midi_merger_t *const) arg;
 
-  if (queue == NULL) {
-    fprintf(stderr, "Queue memory problem.\n");
-  } else {
-    char buffer[sizeof(jack_port_id_t)];
-    read = jack_ringbuffer_read(queue, buffer, sizeof(jack_port_id_t));
-    if (read == sizeof(jack_port_id_t)) {
-      id = (jack_port_id_t) *buffer;
-    }
+  if (mm->config->per_source) {
+    return attach_source(mm, source_name, state);
+  }
+  // Checking locally saves a server round trip for known ports.
+  if (jack_port_connected_to(mm->ports[PORT_IN], source_name)) {
+    return EEXIST;
   }
-  return id;
+  return jack_connect(mm->client, source_name, jack_port_name(mm->ports[PORT_IN]));
 }
 
 
 /**
- * Connect any outstanding Jack ports.
- * It is a consumer in the non-realtime context.
+ * End the notes of a source that is gone, in the next cycle. A source
+ * on `in` only if it was the last one there, the notes of the others
+ * would be ended too.
  */
-void handle_scheduled_connections(midi_merger_t *const mm) {
-  // Check if there are connections scheduled.
-  jack_port_id_t source;
-
-  while ((source = next(mm->ports_to_connect)) != 0) {
-    int result;
-    result = jack_connect(mm->client,
-                          jack_port_name(jack_port_by_id(mm->client, source)),
-                          jack_port_name(mm->ports[PORT_IN]));
-    switch(result) {
-    case 0:
-      // Fine.
-      break;
-    case EEXIST:
-      fprintf(stderr, "Connection exists.\n");
-      break;
-    default:
-      fprintf(stderr, "Could not connect port.\n");
-      break;
-    }
+static void disconnect_source(void *arg, const char *source_name, port_role_state_t *state) {
+  midi_merger_t *const mm = (midi_merger_t *const) arg;
+
+  if (state->slot >= 0 && state->slot < mm->num_sources) {
+    __atomic_store_n(&mm->sources[state->slot].release, true, __ATOMIC_RELAXED);
+    __atomic_store_n(&mm->release_pending, true, __ATOMIC_RELEASE);
+  } else if (state->slot < 0 && jack_port_connected(mm->ports[PORT_IN]) == 0) {
+    __atomic_store_n(&mm->in_release, true, __ATOMIC_RELAXED);
+    __atomic_store_n(&mm->release_pending, true, __ATOMIC_RELEASE);
   }
 }
 
 
-static int process_callback(jack_nframes_t nframes, void *arg)
-{
-  midi_merger_t *const mm = (midi_merger_t *const) arg;
+/**
+ * Allocate a configuration, or take the spare one from the arena.
+ */
+static merger_config_t *new_config(midi_merger_t *const mm) {
+  if (mm->core->arena != NULL) {
+    merger_config_t *const cfg = mm->spare_config;
+    mm->spare_config = NULL;
+    return cfg;
+  }
+  return malloc(sizeof(merger_config_t));
+}
 
-  // Get and clean the output buffer once per cycle.
-  void *output_port_buffer = jack_port_get_buffer(mm->ports[PORT_OUT], nframes);
-  jack_midi_clear_buffer(output_port_buffer);
-
-  // Copy events from the input to the output.
-  void *input_port_buffer = jack_port_get_buffer(mm->ports[PORT_IN], nframes);
-  jack_nframes_t event_count = jack_midi_get_event_count(input_port_buffer);
-  if (event_count > 0) {
-
-    jack_midi_event_t in_event;
-    for (jack_nframes_t i = 0; i < event_count; ++i) {
-      const int SUCCESS = 0;
-      if (jack_midi_event_get(&in_event, input_port_buffer, i) == SUCCESS) {
-        int result;
-        result = jack_midi_event_write(output_port_buffer,
-                                       in_event.time, in_event.buffer, in_event.size);
-        switch(result) {
-        case 0:
-          // Fine.
-          break;
-        case ENOBUFS:
-          fprintf(stderr, "Not enough space for MIDI event.\n");
-          // Fall through
-        default:
-          fprintf(stderr, "Could not write MIDI event.\n");
-          break;
-        }
-      } else {
-        // ENODATA if buffer is empty. We don't handle this and go on.
-      }
+
+static void drop_config(midi_merger_t *const mm, merger_config_t *cfg) {
+  if (mm->core->arena != NULL) {
+    if (cfg != NULL) {
+      mm->spare_config = cfg;
     }
+  } else {
+    free(cfg);
   }
+}
 
-  return 0;
+
+/**
+ * Free the replaced configuration once the process callback has
+ * picked up a newer one. Returns true if there is none left.
+ */
+static bool reclaim_config(midi_merger_t *const mm) {
+  if (mm->retired_config == NULL) {
+    return true;
+  }
+  if (__atomic_load_n(&mm->config_in_use, __ATOMIC_SEQ_CST) == mm->retired_config) {
+    return false;
+  }
+  drop_config(mm, mm->retired_config);
+  mm->retired_config = NULL;
+  return true;
 }
 
 
-static void port_registration_callback(jack_port_id_t port_id, int is_registered, void *arg)
-{
-  midi_merger_t *const mm = (midi_merger_t *const) arg;
+static jack_nframes_t spill_max_age(jack_client_t *client, const merger_config_t *cfg) {
+  return (jack_nframes_t) ((uint64_t) cfg->spill_age_ms * jack_get_sample_rate(client) / 1000);
+}
 
-  // If there is a new port of type MIDI output we connect it to our
-  // input port.
-  if (is_registered) {
-    jack_port_t *source = jack_port_by_id(mm->client, port_id);
 
-    // Check if MIDI output
-    if ((jack_port_flags(source) & target_port_flags) == target_port_flags) {
-      const char *const ptype = jack_port_type(source);
-      if (ptype && strcmp(ptype, JACK_DEFAULT_MIDI_TYPE) == 0) {
+/**
+ * Replace the configuration with `options` parsed on top of the
+ * defaults. The new one is built here and published with a single
+ * pointer store, the process callback never sees a partial update.
+ * It is called by the supervisor for commands on the control socket.
+ */
+static int reconfigure(void *arg, const char *options) {
+  midi_merger_t *const mm = (midi_merger_t *const) arg;
 
-        // We can't call jack_connect here in the callback,
-        // Schedule the connection for later.
-        push_back(mm->ports_to_connect, port_id);
-        sem_post(&mm->sem);
-      }
+  // Only one replaced configuration is kept around. The process
+  // callback wakes the supervisor when it lets go of it, the command
+  // waits until then.
+  if (!reclaim_config(mm)) {
+    return -EAGAIN;
+  }
+
+  merger_config_t *const cfg = new_config(mm);
+  if (!cfg) {
+    return -ENOMEM;
+  }
+  merger_config_init(cfg);
+  const int errors = merger_config_parse(cfg, options);
+  if (errors != 0) {
+    drop_config(mm, cfg);
+    return errors;
+  }
+  merger_config_keep_fixed(cfg, mm->config);
+
+  mm->retired_config = mm->config;
+  __atomic_store_n(&mm->spill_max_age, spill_max_age(mm->client, cfg), __ATOMIC_RELAXED);
+  __atomic_store_n(&mm->config, cfg, __ATOMIC_SEQ_CST);
+
+  // Priorities come from the port names, resolve them again.
+  pthread_mutex_lock(&mm->sources_lock);
+  for (int i = 0; i < mm->num_sources; ++i) {
+    merger_source_t *const source = &mm->sources[i];
+    const char **const connections = jack_port_get_connections(source->port);
+    __atomic_store_n(&source->priority,
+                     connections ? merger_config_priority(cfg, connections[0]) : 0,
+                     __ATOMIC_RELAXED);
+    if (connections) {
+      jack_free(connections);
     }
   }
-  return;
+  pthread_mutex_unlock(&mm->sources_lock);
+
+  reclaim_config(mm);
+  fprintf(stderr, "New configuration: %s\n", options);
+  return 0;
+}
+
+
+/**
+ * The control thread wakes the supervisor for a command.
+ */
+static void wake_core(void *arg) {
+  midi_core_wake((midi_core_t *) arg);
 }
 
 
 /**
- * `Supervise` handles the non-realtime port connections.
+ * The merger's part of the supervisor: apply control commands, free
+ * replaced configurations, write the capture and publish the
+ * connection counters.
  */
-void *supervise(void *arg) {
+static bool poll_merger(void *arg) {
   midi_merger_t *const mm = (midi_merger_t *const) arg;
 
-  while (mm->do_exit == false) {
-    handle_scheduled_connections(mm);
-    sem_wait(&mm->sem);
+  merger_control_serve(&mm->control, reconfigure, mm);
+  reclaim_config(mm);
+  if (merger_capture_active(&mm->capture)) {
+    merger_capture_flush(&mm->capture);
   }
-  return NULL;
+
+  merger_stats_publish_connections(mm->stats, &mm->core->connection_stats);
+  __atomic_store_n(&mm->stats->registrations_dropped,
+                   __atomic_load_n(&mm->core->registrations_dropped, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+
+  // Look for captured events. Commands and the process callback,
+  // when it picks up a new configuration, wake the supervisor.
+  return merger_capture_active(&mm->capture);
 }
 
-int jack_initialize(jack_client_t* client, const char* load_init)
+
+/**
+ * Free the merger and everything allocated by `merger_create()` along
+ * with it.
+ */
+static void free_merger(midi_merger_t *const mm) {
+  merger_control_close(&mm->control, mm->config->control_path);
+  midi_core_free(mm->core, mm->spare_config);
+  midi_core_free(mm->core, mm->retired_config);
+  midi_core_free(mm->core, mm->config);
+  spill_queue_free(&mm->spill);
+  spill_queue_free(&mm->sysex);
+  merger_capture_close(&mm->capture);
+  if (mm->stats_locked) {
+    munlock(mm->stats, sizeof(merger_stats_t));
+  }
+  merger_stats_destroy(mm->stats, mm->stats_name[0] != '\0' ? mm->stats_name : NULL);
+  pthread_mutex_destroy(&mm->sources_lock);
+  midi_core_free(mm->core, mm);
+}
+
+
+midi_merger_t *merger_create(midi_core_t *core, merger_config_t *config)
 {
-  midi_merger_t *const mm = malloc(sizeof(midi_merger_t));
-  if (!mm) {
+  midi_merger_t *const mm = midi_core_alloc(core, sizeof(midi_merger_t));
+  merger_config_t *const spare = core->arena ? midi_core_alloc(core, sizeof(merger_config_t)) : NULL;
+  if (!mm || (core->arena && !spare)) {
     fprintf(stderr, "Out of memory\n");
-    return EXIT_FAILURE;
+    midi_core_free(core, spare);
+    midi_core_free(core, mm);
+    midi_core_free(core, config);
+    return NULL;
   }
 
+  jack_client_t *const client = core->client;
+  mm->core = core;
   mm->client = client;
 
+  mm->config = config;
+  mm->config_in_use = mm->config;
+  mm->retired_config = NULL;
+  mm->spare_config = spare;
+  mm->control.socket = -1;
+
+  mm->num_sources = 0;
+  pthread_mutex_init(&mm->sources_lock, NULL);
+  mm->release_pending = false;
+  note_state_init(&mm->in_notes);
+  mm->in_release = false;
+  controller_slots_init(&mm->overflow_slots);
+  controller_slots_init(&mm->coalesce_slots);
+  controller_slots_init(&mm->throttle_slots);
+
+  // Export the counters as `/<client name>` unless configured otherwise.
+  mm->stats_name[0] = '\0';
+  if (mm->config->stats) {
+    if (mm->config->stats_name[0] != '\0') {
+      strcpy(mm->stats_name, mm->config->stats_name);
+    } else {
+      snprintf(mm->stats_name, sizeof(mm->stats_name), "/%s", jack_get_client_name(client));
+      for (char *c = mm->stats_name + 1; *c != '\0'; ++c) {
+        if (*c == '/') {
+          *c = '_';
+        }
+      }
+    }
+  }
+  mm->stats = merger_stats_create(mm->stats_name[0] != '\0' ? mm->stats_name : NULL);
+  if (!mm->stats) {
+    fprintf(stderr, "Out of memory\n");
+    pthread_mutex_destroy(&mm->sources_lock);
+    midi_core_free(core, mm->spare_config);
+    midi_core_free(core, mm->config);
+    midi_core_free(core, mm);
+    return NULL;
+  }
+  // The process callback writes the counters, lock them along with the
+  // arena.
+  mm->stats_locked = core->arena != NULL && mlock(mm->stats, sizeof(merger_stats_t)) == 0;
+
+  // MIDI 2.0 ports carry UMP, the server converts from and to MIDI 1.0
+  // ports. Only newer Jack headers have them.
+  mm->port_flags = 0;
+  if (mm->config->format == FORMAT_UMP) {
+#ifdef HAVE_JACK_MIDI2
+    mm->port_flags = JackPortIsMIDI2;
+#else
+    fprintf(stderr, "This Jack has no MIDI 2.0 ports, using MIDI 1.0.\n");
+    mm->config->format = FORMAT_MIDI1;
+#endif
+  }
+
+  // Both are freed by `free_merger()`, even if only one is allocated.
+  const int spill_result = spill_queue_init(&mm->spill, (size_t) mm->config->spill, core->arena);
+  // UMP comes with SysEx in packets already.
+  const size_t sysex_pool = mm->config->format == FORMAT_UMP ? 0 : (size_t) mm->config->sysex_pool;
+  const int sysex_result = spill_queue_init(&mm->sysex, sysex_pool, core->arena);
+  if (spill_result != 0 || sysex_result != 0) {
+    fprintf(stderr, "Out of memory\n");
+    free_merger(mm);
+    return NULL;
+  }
+
+  if (mm->config->capture_path[0] != '\0') {
+    capture_header_t header = {
+      .magic = CAPTURE_MAGIC,
+      .version = CAPTURE_VERSION,
+      .sample_rate = jack_get_sample_rate(client),
+      .format = (uint32_t) mm->config->format,
+      .buffer_size = (uint32_t) jack_port_type_get_buffer_size(client, JACK_DEFAULT_MIDI_TYPE),
+    };
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.started_ns = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+    if (merger_capture_open(&mm->capture, mm->config->capture_path,
+                            (size_t) mm->config->capture_size, &header, core->arena) != 0) {
+      free_merger(mm);
+      return NULL;
+    }
+  }
+
+  mm->spill_backlog = false;
+  mm->spill_max_age = spill_max_age(client, mm->config);
+  mm->sysex_written = 0;
+  mm->sysex_held = 0;
+  mm->sysex_budget_left = 0;
+  mm->sample_rate = jack_get_sample_rate(client);
+  for (int i = 0; i <= MAX_SOURCES; ++i) {
+    for (int cls = 0; cls < MSG_CLASS_COUNT; ++cls) {
+      rate_bucket_init(&mm->rate_buckets[i][cls]);
+    }
+  }
+  mm->clock_master = -1;
+  mm->clock_last_tick = 0;
+  mm->clock_interval = 0;
+  mm->sensing_due = 0;
+  mm->frames = 0;
+  mm->wake_supervisor = false;
+  memset(&mm->process_stats, 0, sizeof(merger_process_stats_t));
+
   // Register ports.
   mm->ports[PORT_IN] = jack_port_register(client, "in",
                                           JACK_DEFAULT_MIDI_TYPE,
-                                          JackPortIsInput, 0);
+                                          JackPortIsInput | mm->port_flags, 0);
   mm->ports[PORT_OUT] = jack_port_register(client, "out",
                                            JACK_DEFAULT_MIDI_TYPE,
-                                           JackPortIsOutput, 0);
+                                           JackPortIsOutput | mm->port_flags, 0);
   for (int i = 0; i < PORT_ARRAY_SIZE; ++i) {
     if (!mm->ports[i]) {
       fprintf(stderr, "Can't register jack port\n");
-      free(mm);
-      return EXIT_FAILURE;
+      free_merger(mm);
+      return NULL;
     }
   }
 
@@ -187,74 +410,37 @@ int jack_initialize(jack_client_t* client, const char* load_init)
   jack_port_set_alias(mm->ports[PORT_IN], "MIDI in");
   jack_port_set_alias(mm->ports[PORT_OUT], "MIDI out");
 
-  // Create the ringbuffer (single-producer/single-consumer) for
-  // scheduled port connections. It contains elements of type
-  // `jack_port_id_t`.
-  mm->ports_to_connect = jack_ringbuffer_create(queue_size);
-
-  // Set callbacks
-  jack_set_process_callback(client, process_callback, mm);
-  jack_set_port_registration_callback(client, port_registration_callback, mm);
-
-  // Init the connection supervisor worker thread
-  sem_init(&mm->sem, 0, 0);
-  mm->do_exit = false;
-  int rc = pthread_create(&(mm->connection_supervisor), NULL, &supervise, mm);
-  if (rc != 0) {
-    fprintf(stderr, "Can't create worker thread\n");
-    return EXIT_FAILURE;
-  }
-
-  /* Activate the jack client */
-  if (jack_activate(client) != 0) {
-    fprintf(stderr, "can't activate jack client\n");
-    free(mm);
-    return EXIT_FAILURE;
-  }
-
-  const char **const ports = jack_get_ports(client, "", JACK_DEFAULT_MIDI_TYPE, target_port_flags);
-  if (ports != NULL)
-  {
-    char  aliases[2][320];
-    char* aliasesptr[2] = { aliases[0], aliases[1] };
-    const char* const ourportname = jack_port_name(mm->ports[PORT_IN]);
-
-    for (int i=0; ports[i] != NULL; ++i) {
-      if (strncmp(ports[i], "system_midi:Midi Through", 24) == 0)
-        continue;
-
-      if (strncmp(ports[i], "system:midi_capture_", 20) == 0 || strncmp(ports[i], "system_midi:capture_", 20) == 0) {
-        if (jack_port_get_aliases(jack_port_by_name(client, ports[i]), aliasesptr) > 0) {
-          if (strncmp(aliases[0], "alsa_pcm:Midi-Through/", 22) == 0) {
-            continue;
-          }
-        }
-      }
-      jack_connect(client, ports[i], ourportname);
+  if (mm->config->control_path[0] != '\0') {
+    if (merger_control_open(&mm->control, mm->config->control_path,
+                            wake_core, core) != 0) {
+      free_merger(mm);
+      return NULL;
     }
-
-    jack_free(ports);
   }
 
-  return 0;
+  const midi_role_t role = {
+    .target_flags = target_port_flags,
+    .connect = connect_source,
+    .disconnect = disconnect_source,
+    .process = merger_process_callback,
+    .poll = poll_merger,
+    .arg = mm,
+  };
+  midi_core_add_role(core, &role);
+
+  return mm;
 }
 
 
-void jack_finish(void* arg)
+void merger_destroy(midi_merger_t *mm)
 {
-  midi_merger_t *const mm = (midi_merger_t *const) arg;
-
-  jack_deactivate(mm->client);
-
+  // The supervisor is gone, no more sources get attached.
   for (int i = 0; i < PORT_ARRAY_SIZE; ++i) {
     jack_port_unregister(mm->client, mm->ports[i]);
   }
+  for (int i = 0; i < mm->num_sources; ++i) {
+    jack_port_unregister(mm->client, mm->sources[i].port);
+  }
 
-  mm->do_exit = true;
-  sem_post(&mm->sem);
-  pthread_join(mm->connection_supervisor, NULL);
-  sem_destroy(&mm->sem);
-  jack_ringbuffer_free(mm->ports_to_connect);
-
-  free(mm);
+  free_merger(mm);
 }
@@ -7,11 +7,20 @@
 #include <string.h>
 #include <jack/jack.h>
 #include <jack/midiport.h>
-#include <jack/ringbuffer.h>
 #include <pthread.h>
 #include <stdbool.h>
 
-#include "mod-semaphore.h"
+#include "midi-core.h"
+#include "controller-slots.h"
+#include "note-state.h"
+#include "rate-limit.h"
+#include "spill-queue.h"
+#include "rt-log.h"
+#include "merger-config.h"
+#include "merger-capture.h"
+#include "merger-control.h"
+#include "merger-stats.h"
+#include "ump.h"
 
 enum Ports {
     PORT_IN,
@@ -19,26 +28,168 @@ enum Ports {
     PORT_ARRAY_SIZE // this is not used as a port index
 };
 
-static const size_t queue_size = 64*sizeof(jack_port_id_t);
+/* maximum number of per-source input ports */
+#define MAX_SOURCES 64
+
+#if MERGER_STATS_INPUTS != MAX_SOURCES + 1
+#error "MERGER_STATS_INPUTS has to count `in` and every source"
+#endif
+
+/* size of port name buffers, including the client name */
+#define PORT_NAME_SIZE 320
+
+typedef struct MERGER_SOURCE_T {
+  // Our input port for this source. It is kept when the source goes
+  // away and reused for the next one.
+  jack_port_t *port;
+  int priority;
+  // Registration time of a replugged source until its first event,
+  // 0 otherwise.
+  uint64_t replugged_ns;
+  // Notes and pedals held by the source, written by the process
+  // callback. `release` is set when the source is gone, its notes are
+  // ended in the next cycle.
+  note_state_t notes;
+  bool release;
+  // Taken by a source that is being connected.
+  bool attaching;
+} merger_source_t;
+
+/**
+ * A value held back by the rate limits, a MIDI message or a packet.
+ */
+typedef struct THROTTLED_VALUE_T {
+  uint8_t cls;
+  uint8_t size;
+  jack_midi_data_t data[UMP_MAX_PACKET_SIZE];
+} throttled_value_t;
+
+/**
+ * Read position in one input buffer during the k-way merge.
+ */
+typedef struct MERGE_CURSOR_T {
+  void *buffer;
+  jack_nframes_t count;
+  jack_nframes_t index;
+  int priority;
+  int order;
+  jack_midi_event_t event;
+} merge_cursor_t;
 
 typedef struct MIDI_MERGER_T {
+  midi_core_t *core;
   jack_client_t *client;
   jack_port_t *ports[PORT_ARRAY_SIZE];
-  jack_ringbuffer_t *ports_to_connect;
+  // Added to the flags of all our ports, for MIDI 2.0 ports.
+  unsigned long port_flags;
+
+  // The configuration, replaced at runtime through the control socket.
+  // The process callback picks it up at the start of every cycle and
+  // stores it in `config_in_use`. A replaced configuration is kept in
+  // `retired_config` until the process callback has moved past it.
+  merger_config_t *config;
+  const merger_config_t *config_in_use;
+  merger_config_t *retired_config;
+  // With `memory=locked` configurations come from the arena, the one
+  // not in use is kept for the next command.
+  merger_config_t *spare_config;
+  merger_control_t control;
+
+  // Per-source input ports. Slots below `num_sources` are in use and
+  // never removed, the process callback reads `num_sources` with
+  // acquire semantics.
+  merger_source_t sources[MAX_SOURCES];
+  int num_sources;
+  pthread_mutex_t sources_lock;
+  // Set with the `release` of a source, so the process callback only
+  // looks at the sources when one is gone.
+  bool release_pending;
+  // Notes and pedals held on `in`, as for a source. The sources mixed
+  // by the server on `in` can't be told apart, so they are only ended
+  // when the last source connected to `in` is gone.
+  note_state_t in_notes;
+  bool in_release;
+
+  // Rate limits per input, `in` first, and message class. A source
+  // keeps its buckets when it is replugged.
+  rate_bucket_t rate_buckets[MAX_SOURCES + 1][MSG_CLASS_COUNT];
+  // The newest continuous value per channel and controller that was
+  // over the limit, kept across cycles until the bucket of its input,
+  // the slot's `source`, allows it. The value of a slot is at the same
+  // index in `throttled`, its size is 0 once it is written or out of
+  // date.
+  controller_slots_t throttle_slots;
+  throttled_value_t throttled[CONTROLLER_SLOTS];
+  jack_nframes_t sample_rate;
+
+  // The clock master, an input as in `throttled`, or -1. The frame of
+  // its last tick and the interval to the one before, 0 until known,
+  // tell when it went silent.
+  int clock_master;
+  uint64_t clock_last_tick;
+  uint64_t clock_interval;
+  // Frame from which the next Active Sensing is written.
+  uint64_t sensing_due;
 
-  bool do_exit;
-  pthread_t connection_supervisor;
-  sem_t sem;
+  // Scratch space for the k-way merge in the process callback, one
+  // cursor per source plus `in`.
+  merge_cursor_t merge_heap[MAX_SOURCES + 1];
+
+  // Latest controller values held back by the overflow policy in this
+  // cycle.
+  controller_slots_t overflow_slots;
+
+  // Where the last value of each continuous controller in this cycle
+  // comes from, for coalescing.
+  controller_slots_t coalesce_slots;
+
+  // Events that didn't fit, written at the start of the next cycle.
+  // While it has a backlog all new events are queued behind it.
+  spill_queue_t spill;
+  bool spill_backlog;
+  jack_nframes_t spill_max_age;
+
+  // SysEx messages written in chunks of at most `sysex_budget` bytes
+  // per cycle, split at message boundaries, with the events held back
+  // while one is partly written: anything but realtime messages would
+  // end it. `sysex_written` bytes of the first one are out.
+  spill_queue_t sysex;
+  uint32_t sysex_written;
+  uint32_t sysex_held;
+  size_t sysex_budget_left;
+
+  // Frames processed since the client started.
+  uint64_t frames;
+
+  // Inputs and output recorded with `capture=`, inactive otherwise.
+  merger_capture_t capture;
+
+  // Set when messages were logged in this cycle.
+  bool wake_supervisor;
+
+  // Counters of the process callback, copied to `stats` by it. The
+  // supervisor publishes the connection counters of the core.
+  // `stats_name` is empty if they are not exported.
+  merger_stats_t *stats;
+  char stats_name[MERGER_STATS_NAME_SIZE];
+  bool stats_locked;
+  merger_process_stats_t process_stats;
 } midi_merger_t;
 
 /**
- * For use as a Jack-internal client, `jack_initialize()` and
- * `jack_finish()` have to be exported in the shared library.
+ * Set up the merger with its ports and add it to the roles of `core`.
+ * It takes ownership of `config`. Returns NULL on failure.
+ */
+midi_merger_t *merger_create(midi_core_t *core, merger_config_t *config);
+
+/**
+ * Unregister the ports and free the merger, after the core stopped.
  */
-JACK_LIB_EXPORT
-int jack_initialize(jack_client_t* client, const char* load_init);
+void merger_destroy(midi_merger_t *mm);
 
-JACK_LIB_EXPORT
-void jack_finish(void* arg);
+/**
+ * The process callback, `arg` is the `midi_merger_t`.
+ */
+int merger_process_callback(jack_nframes_t nframes, void *arg);
 
 #endif
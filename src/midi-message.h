@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* --------------------------------------------------------------------- */
+// MIDI 1.0 message classification
+
+typedef enum MIDI_MESSAGE_CLASS {
+    MSG_NOTE_OFF,
+    MSG_NOTE_ON,
+    MSG_POLY_PRESSURE,
+    MSG_CONTROL_CHANGE,
+    MSG_PROGRAM_CHANGE,
+    MSG_CHANNEL_PRESSURE,
+    MSG_PITCH_BEND,
+    MSG_SYSEX,
+    MSG_SYSTEM_COMMON,
+    MSG_REALTIME,
+    MSG_INVALID,
+    MSG_CLASS_COUNT // this is not used as a class
+} midi_message_class_t;
+
+static inline
+bool midi_is_channel_message(uint8_t status)
+{
+    return status >= 0x80 && status < 0xf0;
+}
+
+static inline
+midi_message_class_t midi_classify(const uint8_t *data, size_t size)
+{
+    if (size == 0)
+        return MSG_INVALID;
+
+    const uint8_t status = data[0];
+
+    switch (status & 0xf0)
+    {
+    case 0x80:
+        return MSG_NOTE_OFF;
+    case 0x90:
+        // Note On with velocity 0 is a Note Off.
+        return (size > 2 && data[2] == 0) ? MSG_NOTE_OFF : MSG_NOTE_ON;
+    case 0xa0:
+        return MSG_POLY_PRESSURE;
+    case 0xb0:
+        return MSG_CONTROL_CHANGE;
+    case 0xc0:
+        return MSG_PROGRAM_CHANGE;
+    case 0xd0:
+        return MSG_CHANNEL_PRESSURE;
+    case 0xe0:
+        return MSG_PITCH_BEND;
+    case 0xf0:
+        if (status == 0xf0)
+            return MSG_SYSEX;
+        if (status >= 0xf8)
+            return MSG_REALTIME;
+        return MSG_SYSTEM_COMMON;
+    default:
+        // Running status or a stray data byte.
+        return MSG_INVALID;
+    }
+}
+
+/**
+ * Continuous controller data, where only the latest value matters:
+ * control change, pitch bend and both kinds of aftertouch.
+ */
+static inline
+bool midi_is_continuous(midi_message_class_t cls)
+{
+    return cls == MSG_CONTROL_CHANGE || cls == MSG_PITCH_BEND
+        || cls == MSG_CHANNEL_PRESSURE || cls == MSG_POLY_PRESSURE;
+}
+
+/**
+ * Key of a continuous message: status byte (type and channel) in the
+ * high byte, the controller or note number in the low byte.
+ */
+static inline
+uint16_t midi_continuous_key(const uint8_t *data, size_t size, midi_message_class_t cls)
+{
+    const bool numbered = cls == MSG_CONTROL_CHANGE || cls == MSG_POLY_PRESSURE;
+    const uint8_t number = (numbered && size > 1) ? data[1] : 0;
+    return (uint16_t) ((data[0] << 8) | number);
+}
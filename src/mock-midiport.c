@@ -0,0 +1,152 @@
+#include "mock-midiport.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the same as the `JackMidiEvent` header of Jack2 */
+#define EVENT_HEADER_SIZE 12
+#define INLINE_DATA_SIZE 4
+
+typedef struct MOCK_EVENT_T {
+  jack_nframes_t time;
+  size_t size;
+  size_t offset;
+} mock_event_t;
+
+typedef struct MOCK_MIDI_BUFFER_T {
+  size_t buffer_size;
+  size_t used;
+  uint32_t event_count;
+  uint32_t lost_events;
+  uint32_t max_events;
+  mock_event_t *events;
+  jack_midi_data_t *data;
+  size_t data_used;
+} mock_midi_buffer_t;
+
+struct _jack_port {
+  mock_midi_buffer_t buffer;
+};
+
+
+jack_port_t *mock_port_create(size_t buffer_size) {
+  jack_port_t *const port = calloc(1, sizeof(jack_port_t));
+  if (port == NULL) {
+    return NULL;
+  }
+
+  mock_midi_buffer_t *const buffer = &port->buffer;
+  buffer->buffer_size = buffer_size;
+  buffer->max_events = (uint32_t) (buffer_size / EVENT_HEADER_SIZE);
+  buffer->events = calloc(buffer->max_events + 1, sizeof(mock_event_t));
+  buffer->data = malloc(buffer_size);
+  if (buffer->events == NULL || buffer->data == NULL) {
+    mock_port_destroy(port);
+    return NULL;
+  }
+  return port;
+}
+
+
+void mock_port_destroy(jack_port_t *port) {
+  free(port->buffer.events);
+  free(port->buffer.data);
+  free(port);
+}
+
+
+void *jack_port_get_buffer(jack_port_t *port, jack_nframes_t nframes) {
+  return &port->buffer;
+}
+
+
+uint32_t jack_midi_get_event_count(void *port_buffer) {
+  return ((mock_midi_buffer_t *) port_buffer)->event_count;
+}
+
+
+int jack_midi_event_get(jack_midi_event_t *event, void *port_buffer, uint32_t event_index) {
+  mock_midi_buffer_t *const buffer = (mock_midi_buffer_t *) port_buffer;
+  if (event_index >= buffer->event_count) {
+    return ENODATA;
+  }
+
+  const mock_event_t *const e = &buffer->events[event_index];
+  event->time = e->time;
+  event->size = e->size;
+  event->buffer = buffer->data + e->offset;
+  return 0;
+}
+
+
+void jack_midi_clear_buffer(void *port_buffer) {
+  mock_midi_buffer_t *const buffer = (mock_midi_buffer_t *) port_buffer;
+  buffer->used = 0;
+  buffer->event_count = 0;
+  buffer->lost_events = 0;
+  buffer->data_used = 0;
+}
+
+
+void jack_midi_reset_buffer(void *port_buffer) {
+  jack_midi_clear_buffer(port_buffer);
+}
+
+
+size_t jack_midi_max_event_size(void *port_buffer) {
+  mock_midi_buffer_t *const buffer = (mock_midi_buffer_t *) port_buffer;
+  const size_t reserved = buffer->used + EVENT_HEADER_SIZE;
+  return reserved < buffer->buffer_size ? buffer->buffer_size - reserved : 0;
+}
+
+
+jack_midi_data_t *jack_midi_event_reserve(void *port_buffer, jack_nframes_t time,
+                                          size_t data_size) {
+  mock_midi_buffer_t *const buffer = (mock_midi_buffer_t *) port_buffer;
+
+  if (buffer->event_count > 0
+      && time < buffer->events[buffer->event_count - 1].time) {
+    ++buffer->lost_events;
+    return NULL;
+  }
+
+  const size_t cost = EVENT_HEADER_SIZE + (data_size > INLINE_DATA_SIZE ? data_size : 0);
+  if (data_size == 0 || buffer->used + cost > buffer->buffer_size
+      || buffer->data_used + data_size > buffer->buffer_size) {
+    ++buffer->lost_events;
+    return NULL;
+  }
+
+  mock_event_t *const e = &buffer->events[buffer->event_count++];
+  e->time = time;
+  e->size = data_size;
+  e->offset = buffer->data_used;
+  buffer->used += cost;
+  buffer->data_used += data_size;
+  return buffer->data + e->offset;
+}
+
+
+int jack_midi_event_write(void *port_buffer, jack_nframes_t time,
+                          const jack_midi_data_t *data, size_t data_size) {
+  mock_midi_buffer_t *const buffer = (mock_midi_buffer_t *) port_buffer;
+
+  if (buffer->event_count > 0
+      && time < buffer->events[buffer->event_count - 1].time) {
+    return EINVAL;
+  }
+
+  jack_midi_data_t *const dest = jack_midi_event_reserve(port_buffer, time, data_size);
+  if (dest == NULL) {
+    return ENOBUFS;
+  }
+  memcpy(dest, data, data_size);
+  return 0;
+}
+
+
+uint32_t jack_midi_get_lost_event_count(void *port_buffer) {
+  return ((mock_midi_buffer_t *) port_buffer)->lost_events;
+}
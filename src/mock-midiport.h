@@ -0,0 +1,24 @@
+#ifndef MOCK_MIDIPORT_H
+#define MOCK_MIDIPORT_H
+
+#include <stddef.h>
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+/*
+ * An in-memory implementation of the Jack MIDI buffer API and of
+ * `jack_port_get_buffer()`, to run the process callback without a
+ * server. Link it instead of libjack.
+ *
+ * Buffers account for space like Jack2: every event takes a fixed size
+ * header and events of more than four bytes take their data on top.
+ */
+
+/**
+ * Create a port with a MIDI buffer of `buffer_size` bytes.
+ */
+jack_port_t *mock_port_create(size_t buffer_size);
+
+void mock_port_destroy(jack_port_t *port);
+
+#endif
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* --------------------------------------------------------------------- */
+// Held notes and sustain pedals of one source
+
+/* controllers that end notes */
+#define NOTE_STATE_CC_SUSTAIN 64
+#define NOTE_STATE_CC_ALL_SOUND_OFF 120
+#define NOTE_STATE_CC_ALL_NOTES_OFF 123
+
+/**
+ * One bit per note and channel, and per channel whether any note is
+ * held and whether the sustain pedal is down. Releasing everything
+ * takes time proportional to the held notes.
+ */
+typedef struct NOTE_STATE_T {
+    uint64_t notes[16][2];
+    uint16_t channels;
+    uint16_t sustain;
+} note_state_t;
+
+typedef void (*note_state_write_t)(void* arg, const uint8_t data[3]);
+
+static inline
+void note_state_init(note_state_t* state)
+{
+    memset(state, 0, sizeof(note_state_t));
+}
+
+/**
+ * Update the state with a message that was sent.
+ */
+static inline
+void note_state_update(note_state_t* state, const uint8_t* data, size_t size)
+{
+    if (size < 3)
+        return;
+
+    const uint8_t type = data[0] & 0xf0;
+    const int channel = data[0] & 0x0f;
+    const uint16_t channel_bit = (uint16_t) (1 << channel);
+
+    if (type == 0x90 || type == 0x80) {
+        uint64_t* const word = &state->notes[channel][(data[1] >> 6) & 1];
+        const uint64_t bit = 1ull << (data[1] & 63);
+
+        if (type == 0x90 && data[2] > 0) {
+            *word |= bit;
+            state->channels |= channel_bit;
+        } else {
+            *word &= ~bit;
+            if ((state->notes[channel][0] | state->notes[channel][1]) == 0)
+                state->channels &= (uint16_t) ~channel_bit;
+        }
+    } else if (type == 0xb0) {
+        if (data[1] == NOTE_STATE_CC_SUSTAIN) {
+            if (data[2] >= 64)
+                state->sustain |= channel_bit;
+            else
+                state->sustain &= (uint16_t) ~channel_bit;
+        } else if (data[1] == NOTE_STATE_CC_ALL_SOUND_OFF
+                   || data[1] == NOTE_STATE_CC_ALL_NOTES_OFF) {
+            state->notes[channel][0] = state->notes[channel][1] = 0;
+            state->channels &= (uint16_t) ~channel_bit;
+        }
+    }
+}
+
+/**
+ * Write a Note Off for every held note and release the sustain pedals
+ * that are down, then forget them. Returns the number of messages.
+ */
+static inline
+unsigned note_state_release(note_state_t* state, note_state_write_t write, void* arg)
+{
+    unsigned count = 0;
+    uint8_t data[3];
+
+    for (unsigned channels = state->channels; channels != 0; channels &= channels - 1) {
+        const int channel = __builtin_ctz(channels);
+        data[0] = (uint8_t) (0x80 | channel);
+        data[2] = 0;
+        for (int half = 0; half < 2; ++half) {
+            for (uint64_t notes = state->notes[channel][half]; notes != 0; notes &= notes - 1) {
+                data[1] = (uint8_t) (half * 64 + __builtin_ctzll(notes));
+                write(arg, data);
+                ++count;
+            }
+            state->notes[channel][half] = 0;
+        }
+    }
+
+    for (unsigned channels = state->sustain; channels != 0; channels &= channels - 1) {
+        data[0] = (uint8_t) (0xb0 | __builtin_ctz(channels));
+        data[1] = NOTE_STATE_CC_SUSTAIN;
+        data[2] = 0;
+        write(arg, data);
+        ++count;
+    }
+
+    state->channels = 0;
+    state->sustain = 0;
+    return count;
+}
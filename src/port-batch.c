@@ -0,0 +1,136 @@
+#include "port-batch.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+size_t port_batch_drain(port_batch_t *batch, port_queue_t *queue) {
+  port_event_t *const events = batch->events;
+  const size_t count = port_queue_pop_bulk(queue, events, PORT_BATCH_SIZE);
+
+  batch->count = 0;
+  batch->duplicates = 0;
+  if (count == 0) {
+    return 0;
+  }
+
+  // Insertion sort by id is stable, so the events of one port stay in
+  // queue order and the last one is the latest.
+  for (size_t i = 1; i < count; ++i) {
+    const port_event_t event = events[i];
+    size_t j = i;
+    while (j > 0 && events[j - 1].id > event.id) {
+      events[j] = events[j - 1];
+      --j;
+    }
+    events[j] = event;
+  }
+
+  size_t unique = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (unique > 0 && events[unique - 1].id == events[i].id) {
+      events[unique - 1] = events[i];
+    } else {
+      events[unique++] = events[i];
+    }
+  }
+  batch->duplicates = count - unique;
+  batch->count = unique;
+  return unique;
+}
+
+
+bool port_is_midi_through(jack_client_t *client, const char *port_name) {
+  if (strncmp(port_name, "system_midi:Midi Through", 24) == 0) {
+    return true;
+  }
+
+  if (strncmp(port_name, "system:midi_", 12) == 0 || strncmp(port_name, "system_midi:", 12) == 0) {
+    char  aliases[2][320];
+    char* aliasesptr[2] = { aliases[0], aliases[1] };
+    jack_port_t *const port = jack_port_by_name(client, port_name);
+
+    if (port && jack_port_get_aliases(port, aliasesptr) > 0) {
+      if (strncmp(aliases[0], "alsa_pcm:Midi-Through/", 22) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+/**
+ * Append the letters and digits of `name[0..length)`, in lower case,
+ * so differences in spacing and punctuation between the ALSA and a2j
+ * names don't matter.
+ */
+static size_t normalize(char *out, size_t size, const char *name, size_t length) {
+  size_t n = 0;
+  for (size_t i = 0; i < length && n + 1 < size; ++i) {
+    if (isalnum((unsigned char) name[i])) {
+      out[n++] = (char) tolower((unsigned char) name[i]);
+    }
+  }
+  out[n] = '\0';
+  return n;
+}
+
+
+/**
+ * Number at the end of `name[0..length)`, 1 if there is none.
+ */
+static int trailing_number(const char *name, size_t length) {
+  size_t start = length;
+  while (start > 0 && isdigit((unsigned char) name[start - 1])) {
+    --start;
+  }
+  return start < length ? atoi(name + start) : 1;
+}
+
+
+bool port_device_identity(const char *port_name, const char *alias, int flags,
+                          char *identity, size_t size) {
+  char device[PORT_IDENTITY_SIZE];
+  int number = 0;
+
+  const char *a2j = strncmp(port_name, "a2j:", 4) == 0 ? port_name
+                  : strncmp(alias, "a2j:", 4) == 0 ? alias : NULL;
+  if (a2j) {
+    // `a2j:<client> [<id>] (capture|playback): <port>`
+    const char *const bracket = strstr(a2j, " [");
+    const char *const colon = strstr(a2j, "): ");
+    if (bracket == NULL || colon == NULL || colon < bracket) {
+      return false;
+    }
+    normalize(device, sizeof(device), a2j + 4, (size_t) (bracket - a2j - 4));
+    number = trailing_number(colon + 3, strlen(colon + 3));
+  } else if (strncmp(alias, "alsa_pcm:", 9) == 0) {
+    // `alsa_pcm:<device>/midi_capture_<n>`
+    const char *const slash = strrchr(alias, '/');
+    if (slash == NULL || strncmp(slash + 1, "midi_", 5) != 0) {
+      return false;
+    }
+    normalize(device, sizeof(device), alias + 9, (size_t) (slash - alias - 9));
+    number = trailing_number(slash + 1, strlen(slash + 1));
+  } else {
+    return false;
+  }
+
+  if (device[0] == '\0') {
+    return false;
+  }
+  snprintf(identity, size, "%s#%d/%s", device, number,
+           (flags & JackPortIsOutput) ? "capture" : "playback");
+  return true;
+}
+
+
+uint64_t port_batch_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
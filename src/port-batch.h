@@ -0,0 +1,55 @@
+#ifndef PORT_BATCH_H
+#define PORT_BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <jack/jack.h>
+
+#include "port-queue.h"
+
+/* most registrations taken from the queue at once */
+#define PORT_BATCH_SIZE 256
+
+/**
+ * Port events taken from the queue, sorted by port id with one event
+ * per port, the latest, so every port is looked up and connected once.
+ */
+typedef struct PORT_BATCH_T {
+  port_event_t events[PORT_BATCH_SIZE];
+  size_t count;
+  // Events dropped because a later one was queued for the same port.
+  size_t duplicates;
+} port_batch_t;
+
+/**
+ * Take up to `PORT_BATCH_SIZE` events from `queue`.
+ * Returns the number of distinct ports in the batch.
+ */
+size_t port_batch_drain(port_batch_t *batch, port_queue_t *queue);
+
+/**
+ * Whether `port_name` is one of the ALSA Midi-Through ports, which
+ * are never connected automatically.
+ */
+bool port_is_midi_through(jack_client_t *client, const char *port_name);
+
+/* size of device identities, including the terminator */
+#define PORT_IDENTITY_SIZE 96
+
+/**
+ * Name the device and port behind a Jack port, the same for the ALSA
+ * raw port, e.g. `alsa_pcm:Keystep/midi_capture_1` as its alias, and
+ * the a2j bridge, e.g. `a2j:Keystep [20] (capture): Keystep MIDI 1`.
+ * `flags` tell the direction. Returns false if neither form is
+ * recognized.
+ */
+bool port_device_identity(const char *port_name, const char *alias, int flags,
+                          char *identity, size_t size);
+
+/**
+ * Time for measuring how long the supervisor takes to catch up.
+ */
+uint64_t port_batch_now_ns(void);
+
+#endif
@@ -0,0 +1,151 @@
+#include "port-cache.h"
+
+#include <string.h>
+
+#define INDEX_MASK (PORT_CACHE_INDEX_SIZE - 1)
+
+
+/**
+ * FNV-1a
+ */
+static uint32_t hash_name(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (const char *c = name; *c != '\0'; ++c) {
+    hash = (hash ^ (uint8_t) *c) * 16777619u;
+  }
+  return hash;
+}
+
+
+/**
+ * Find `key` in one of the indexes, comparing it with the name or the
+ * alias of the ports. Probing stops at the first empty slot.
+ */
+static known_port_t *find(port_cache_t *cache, const int16_t *index, const char *key,
+                          bool alias) {
+  uint32_t slot = hash_name(key) & INDEX_MASK;
+  for (int i = 0; i < PORT_CACHE_INDEX_SIZE; ++i) {
+    if (index[slot] < 0) {
+      return NULL;
+    }
+    known_port_t *const port = &cache->ports[index[slot]];
+    if (strcmp(alias ? port->alias : port->name, key) == 0) {
+      return port;
+    }
+    slot = (slot + 1) & INDEX_MASK;
+  }
+  return NULL;
+}
+
+
+known_port_t *port_cache_find_device(port_cache_t *cache, const char *identity,
+                                     const known_port_t *except, bool suppressed) {
+  if (identity[0] == '\0') {
+    return NULL;
+  }
+
+  // All ports of a device are in one probe sequence.
+  uint32_t slot = hash_name(identity) & INDEX_MASK;
+  for (int i = 0; i < PORT_CACHE_INDEX_SIZE; ++i) {
+    if (cache->by_identity[slot] < 0) {
+      return NULL;
+    }
+    known_port_t *const port = &cache->ports[cache->by_identity[slot]];
+    if (port != except && port->present && port->suppressed == suppressed
+        && strcmp(port->identity, identity) == 0) {
+      return port;
+    }
+    slot = (slot + 1) & INDEX_MASK;
+  }
+  return NULL;
+}
+
+
+static void insert(int16_t *index, const char *key, int16_t position) {
+  uint32_t slot = hash_name(key) & INDEX_MASK;
+  for (int i = 0; i < PORT_CACHE_INDEX_SIZE; ++i) {
+    if (index[slot] < 0) {
+      index[slot] = position;
+      return;
+    }
+    slot = (slot + 1) & INDEX_MASK;
+  }
+  // Full of stale slots, the port can only be found by its id.
+}
+
+
+void port_cache_init(port_cache_t *cache) {
+  cache->count = 0;
+  memset(cache->by_name, 0xff, sizeof(cache->by_name));
+  memset(cache->by_alias, 0xff, sizeof(cache->by_alias));
+  memset(cache->by_identity, 0xff, sizeof(cache->by_identity));
+  memset(cache->by_id, 0xff, sizeof(cache->by_id));
+}
+
+
+known_port_t *port_cache_find(port_cache_t *cache, const char *name) {
+  return find(cache, cache->by_name, name, false);
+}
+
+
+known_port_t *port_cache_find_alias(port_cache_t *cache, const char *alias) {
+  if (alias[0] == '\0') {
+    return NULL;
+  }
+  return find(cache, cache->by_alias, alias, true);
+}
+
+
+known_port_t *port_cache_find_id(port_cache_t *cache, int32_t id) {
+  if (id < 0 || id >= PORT_CACHE_IDS || cache->by_id[id] < 0) {
+    return NULL;
+  }
+  return &cache->ports[cache->by_id[id]];
+}
+
+
+known_port_t *port_cache_add(port_cache_t *cache, const char *name, const char *alias,
+                             const char *identity) {
+  if (cache->count == PORT_CACHE_SIZE) {
+    return NULL;
+  }
+
+  const int16_t position = (int16_t) cache->count++;
+  known_port_t *const port = &cache->ports[position];
+  memset(port, 0, sizeof(known_port_t));
+  strncpy(port->name, name, PORT_CACHE_NAME_SIZE - 1);
+  strncpy(port->alias, alias, PORT_CACHE_NAME_SIZE - 1);
+  strncpy(port->identity, identity, PORT_IDENTITY_SIZE - 1);
+  port->id = -1;
+  for (int i = 0; i < PORT_CACHE_ROLES; ++i) {
+    port->roles[i].slot = -1;
+  }
+
+  insert(cache->by_name, port->name, position);
+  if (port->alias[0] != '\0') {
+    insert(cache->by_alias, port->alias, position);
+  }
+  if (port->identity[0] != '\0') {
+    insert(cache->by_identity, port->identity, position);
+  }
+  return port;
+}
+
+
+void port_cache_rename(port_cache_t *cache, known_port_t *port, const char *name) {
+  memset(port->name, 0, PORT_CACHE_NAME_SIZE);
+  strncpy(port->name, name, PORT_CACHE_NAME_SIZE - 1);
+  insert(cache->by_name, port->name, (int16_t) (port - cache->ports));
+}
+
+
+void port_cache_set_id(port_cache_t *cache, known_port_t *port, int32_t id) {
+  if (port->id >= 0 && port->id < PORT_CACHE_IDS
+      && cache->by_id[port->id] == (int16_t) (port - cache->ports)) {
+    cache->by_id[port->id] = -1;
+  }
+  port->id = id;
+  if (id >= 0 && id < PORT_CACHE_IDS) {
+    cache->by_id[id] = (int16_t) (port - cache->ports);
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef PORT_CACHE_H
+#define PORT_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "port-batch.h"
+
+/* most ports remembered */
+#define PORT_CACHE_SIZE 256
+
+/* slots of the name and alias indexes, has to be a power of two */
+#define PORT_CACHE_INDEX_SIZE 512
+
+/* port ids looked up directly, ports with larger ids aren't tracked */
+#define PORT_CACHE_IDS 4096
+
+/* size of port name buffers, including the client name */
+#define PORT_CACHE_NAME_SIZE 320
+
+/* roles with state per port */
+#define PORT_CACHE_ROLES 2
+
+/**
+ * What a role keeps per port. It survives unplugging, so a replugged
+ * device gets the same settings.
+ */
+typedef struct PORT_ROLE_STATE_T {
+  // The role's own slot for the port, e.g. the merger's input port,
+  // -1 if it has none.
+  int slot;
+  // Registration time of a replugged port, 0 for other ports.
+  uint64_t replugged_ns;
+} port_role_state_t;
+
+typedef struct KNOWN_PORT_T {
+  char name[PORT_CACHE_NAME_SIZE];
+  // The first alias, ALSA devices keep it when they get another name.
+  char alias[PORT_CACHE_NAME_SIZE];
+  // Jack port id, -1 if the port was found by a scan.
+  int32_t id;
+  bool present;
+  // Never connected, e.g. the Midi-Through ports.
+  bool ignored;
+  int flags;
+  // The device and port behind it, empty if unknown. Of the present
+  // ports of a device only the first is connected, the others are
+  // `suppressed` and take over when it goes away.
+  char identity[PORT_IDENTITY_SIZE];
+  bool suppressed;
+  port_role_state_t roles[PORT_CACHE_ROLES];
+} known_port_t;
+
+/**
+ * Ports the supervisor has seen, indexed by name, alias and id. Ports
+ * are never forgotten, renamed ones leave stale index slots behind that
+ * lookups skip. It is used by the supervisor thread only.
+ */
+typedef struct PORT_CACHE_T {
+  known_port_t ports[PORT_CACHE_SIZE];
+  int count;
+  int16_t by_name[PORT_CACHE_INDEX_SIZE];
+  int16_t by_alias[PORT_CACHE_INDEX_SIZE];
+  int16_t by_identity[PORT_CACHE_INDEX_SIZE];
+  int16_t by_id[PORT_CACHE_IDS];
+} port_cache_t;
+
+void port_cache_init(port_cache_t *cache);
+
+known_port_t *port_cache_find(port_cache_t *cache, const char *name);
+known_port_t *port_cache_find_alias(port_cache_t *cache, const char *alias);
+known_port_t *port_cache_find_id(port_cache_t *cache, int32_t id);
+
+/**
+ * Find a present port of the device `identity` other than `except`,
+ * one that is suppressed or one that isn't.
+ */
+known_port_t *port_cache_find_device(port_cache_t *cache, const char *identity,
+                                     const known_port_t *except, bool suppressed);
+
+/**
+ * Add a port that isn't known by name or alias, `alias` and `identity`
+ * may be empty. Returns NULL if the cache is full.
+ */
+known_port_t *port_cache_add(port_cache_t *cache, const char *name, const char *alias,
+                             const char *identity);
+
+/**
+ * Give a port, found by its alias, its new name.
+ */
+void port_cache_rename(port_cache_t *cache, known_port_t *port, const char *name);
+
+/**
+ * Set the id of a registered port, -1 for none.
+ */
+void port_cache_set_id(port_cache_t *cache, known_port_t *port, int32_t id);
+
+#endif
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <jack/types.h>
+
+/* --------------------------------------------------------------------- */
+// Lock-free single-producer/single-consumer queue of port events
+
+/* number of records, has to be a power of two */
+#define PORT_QUEUE_SIZE 256
+#define PORT_QUEUE_MASK (PORT_QUEUE_SIZE - 1)
+
+typedef enum PORT_EVENT_KIND {
+    PORT_REGISTERED,
+    PORT_UNREGISTERED,
+    PORT_EVENT_KIND_COUNT // this is not used as a kind
+} port_event_kind_t;
+
+typedef struct PORT_EVENT_T {
+    jack_port_id_t id;
+    // `JackPortFlags` of the port when the event was queued.
+    uint32_t flags;
+    uint32_t kind;
+    // When the event was queued, for measuring reconnects.
+    uint64_t time_ns;
+} port_event_t;
+
+/**
+ * The producer is the port registration callback, the consumer the
+ * supervisor thread. `head` and `tail` are free running counters on
+ * separate cache lines, each written by one side only.
+ */
+typedef struct PORT_QUEUE_T {
+    port_event_t events[PORT_QUEUE_SIZE];
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+} port_queue_t;
+
+static inline
+void port_queue_init(port_queue_t* queue)
+{
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+/**
+ * Add an event. Returns false if the queue is full.
+ * It is safe to call from the realtime context.
+ */
+static inline
+bool port_queue_push(port_queue_t* queue, jack_port_id_t id, uint32_t flags,
+                     port_event_kind_t kind, uint64_t time_ns)
+{
+    const uint32_t head = queue->head;
+    if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == PORT_QUEUE_SIZE)
+        return false;
+
+    port_event_t* const event = &queue->events[head & PORT_QUEUE_MASK];
+    event->id = id;
+    event->flags = flags;
+    event->kind = kind;
+    event->time_ns = time_ns;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Move up to `max` events into `events`, in the order they were added.
+ * Returns the number of events.
+ */
+static inline
+size_t port_queue_pop_bulk(port_queue_t* queue, port_event_t* events, size_t max)
+{
+    const uint32_t tail = queue->tail;
+    size_t count = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) - tail;
+    if (count > max)
+        count = max;
+
+    for (size_t i = 0; i < count; ++i)
+        events[i] = queue->events[(tail + i) & PORT_QUEUE_MASK];
+
+    __atomic_store_n(&queue->tail, tail + (uint32_t) count, __ATOMIC_RELEASE);
+    return count;
+}
+
+/**
+ * Whether the queue is empty, for the consumer.
+ */
+static inline
+bool port_queue_empty(const port_queue_t* queue)
+{
+    return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == queue->tail;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* --------------------------------------------------------------------- */
+// Token buckets counted in frames
+
+/* a bucket holds the events of this fraction of a second, at least one */
+#define RATE_BURST_DIVISOR 20
+
+/**
+ * The credit is counted in 1/`sample_rate` events: every frame adds
+ * `rate`, an event takes `sample_rate`. Nothing is allocated and all
+ * operations take constant time.
+ */
+typedef struct RATE_BUCKET_T {
+    uint64_t credit;
+    uint64_t last_frame;
+} rate_bucket_t;
+
+/**
+ * Start with a full bucket.
+ */
+static inline
+void rate_bucket_init(rate_bucket_t* bucket)
+{
+    bucket->credit = UINT64_MAX;
+    bucket->last_frame = 0;
+}
+
+/**
+ * Take one event at `frame` if the rate of `rate` events per second
+ * allows it. Returns false if the event is over the limit.
+ */
+static inline
+bool rate_bucket_take(rate_bucket_t* bucket, uint64_t frame, uint32_t rate,
+                      uint32_t sample_rate)
+{
+    const uint32_t burst = rate / RATE_BURST_DIVISOR > 0 ? rate / RATE_BURST_DIVISOR : 1;
+    const uint64_t capacity = (uint64_t) burst * sample_rate;
+    const uint64_t refill = (frame > bucket->last_frame ? frame - bucket->last_frame : 0) * rate;
+
+    // Saturate at the capacity, which also applies a lower rate.
+    if (bucket->credit >= capacity || refill >= capacity - bucket->credit)
+        bucket->credit = capacity;
+    else
+        bucket->credit += refill;
+    bucket->last_frame = frame;
+
+    if (bucket->credit < sample_rate)
+        return false;
+    bucket->credit -= sample_rate;
+    return true;
+}
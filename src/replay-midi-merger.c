@@ -0,0 +1,391 @@
+#include "midi-merger.h"
+#include "mock-midiport.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Feed a capture recorded with `capture=` back through
+ * `merger_process_callback()`, against the mock MIDI buffers, and
+ * compare the output with the recorded one, e.g.
+ *
+ *   $ mod-midi-merger-replay [-r] [-v] <capture> [options]
+ *
+ * The options are the ones of the client. Cycles run at full speed,
+ * with `-r` in real time. `-v` prints the cycles whose output differs.
+ */
+
+/* MIDI port buffers of captures that don't know their size */
+static const size_t default_buffer_size = 32768;
+
+typedef struct REPLAY_T {
+  midi_merger_t *mm;
+  midi_core_t core;
+  size_t buffer_size;
+  jack_nframes_t sample_rate;
+  bool realtime;
+  bool verbose;
+  struct timespec next_cycle;
+
+  // The cycle being read from the capture and the records of its
+  // output, which point into the mapped file.
+  bool in_cycle;
+  uint64_t cycle_frame;
+  jack_nframes_t cycle_length;
+  const capture_record_t **expected;
+  size_t num_expected;
+  size_t max_expected;
+
+  uint64_t cycles;
+  uint64_t cycles_differing;
+  uint64_t events_expected;
+  uint64_t process_ns;
+} replay_t;
+
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+
+/**
+ * Sleep until the cycle is due, the first one starts right away.
+ */
+static void wait_for_cycle(replay_t *replay, jack_nframes_t nframes) {
+  if (replay->next_cycle.tv_sec == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &replay->next_cycle);
+  } else {
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &replay->next_cycle, NULL);
+  }
+  const uint64_t ns = (uint64_t) nframes * 1000000000 / replay->sample_rate;
+  replay->next_cycle.tv_nsec += (long) ns;
+  while (replay->next_cycle.tv_nsec >= 1000000000) {
+    replay->next_cycle.tv_nsec -= 1000000000;
+    ++replay->next_cycle.tv_sec;
+  }
+}
+
+
+static void print_event(const char *label, uint64_t frame, const jack_midi_data_t *data,
+                        size_t size) {
+  printf("  %s %" PRIu64 ":", label, frame);
+  for (size_t i = 0; i < size && i < 16; ++i) {
+    printf(" %02x", data[i]);
+  }
+  if (size > 16) {
+    printf(" ... (%zu bytes)", size);
+  }
+  printf("\n");
+}
+
+
+/**
+ * Compare the output of a cycle with the recorded one.
+ */
+static void compare_output(replay_t *replay, uint64_t cycle_frame) {
+  void *const buffer = jack_port_get_buffer(replay->mm->ports[PORT_OUT], 0);
+  const size_t count = jack_midi_get_event_count(buffer);
+  bool same = count == replay->num_expected;
+
+  for (size_t i = 0; same && i < count; ++i) {
+    const capture_record_t *const record = replay->expected[i];
+    jack_midi_event_t event;
+    same = jack_midi_event_get(&event, buffer, (uint32_t) i) == 0
+        && cycle_frame + event.time == record->frame
+        && event.size == record->size
+        && memcmp(event.buffer, capture_record_data(record), event.size) == 0;
+  }
+  if (same) {
+    return;
+  }
+
+  ++replay->cycles_differing;
+  if (replay->verbose) {
+    printf("cycle at frame %" PRIu64 " differs\n", cycle_frame);
+    for (size_t i = 0; i < replay->num_expected; ++i) {
+      const capture_record_t *const record = replay->expected[i];
+      print_event("recorded", record->frame, capture_record_data(record), record->size);
+    }
+    for (size_t i = 0; i < count; ++i) {
+      jack_midi_event_t event;
+      if (jack_midi_event_get(&event, buffer, (uint32_t) i) == 0) {
+        print_event("replayed", cycle_frame + event.time, event.buffer, event.size);
+      }
+    }
+  }
+}
+
+
+/**
+ * Run one cycle with what was written to the inputs, then empty them.
+ */
+static void run_cycle(replay_t *replay, jack_nframes_t nframes) {
+  midi_merger_t *const mm = replay->mm;
+  const uint64_t cycle_frame = mm->frames;
+
+  if (replay->realtime) {
+    wait_for_cycle(replay, nframes);
+  }
+  const uint64_t start = now_ns();
+  merger_process_callback(nframes, mm);
+  replay->process_ns += now_ns() - start;
+  ++replay->cycles;
+
+  compare_output(replay, cycle_frame);
+  replay->num_expected = 0;
+
+  jack_midi_clear_buffer(jack_port_get_buffer(mm->ports[PORT_IN], nframes));
+  for (int i = 0; i < mm->num_sources; ++i) {
+    jack_midi_clear_buffer(jack_port_get_buffer(mm->sources[i].port, nframes));
+  }
+  rt_log_flush(&replay->core.log, stderr);
+}
+
+
+/**
+ * Finish the current cycle and run empty ones up to `frame`. Idle time
+ * before the first cycle is skipped.
+ */
+static void advance_to(replay_t *replay, uint64_t frame) {
+  midi_merger_t *const mm = replay->mm;
+
+  if (!replay->in_cycle) {
+    mm->frames = frame;
+    return;
+  }
+  run_cycle(replay, replay->cycle_length);
+  while (mm->frames < frame) {
+    const uint64_t left = frame - mm->frames;
+    run_cycle(replay, left < replay->cycle_length ? (jack_nframes_t) left : replay->cycle_length);
+  }
+}
+
+
+/**
+ * The input port of a recorded source, `in_<n>` ports are added as
+ * they show up.
+ */
+static jack_port_t *input_port(replay_t *replay, unsigned source) {
+  midi_merger_t *const mm = replay->mm;
+
+  if (source == 0) {
+    return mm->ports[PORT_IN];
+  }
+  if (source > MAX_SOURCES) {
+    return NULL;
+  }
+  while (mm->num_sources < (int) source) {
+    merger_source_t *const slot = &mm->sources[mm->num_sources];
+    slot->port = mock_port_create(replay->buffer_size);
+    if (slot->port == NULL) {
+      return NULL;
+    }
+    note_state_init(&slot->notes);
+    ++mm->num_sources;
+  }
+  if (!mm->config->per_source) {
+    fprintf(stderr, "The capture has per-source inputs, replaying with inputs=per-source.\n");
+    mm->config->per_source = true;
+  }
+  return mm->sources[source - 1].port;
+}
+
+
+static bool handle_record(replay_t *replay, const capture_record_t *record) {
+  switch (record->source) {
+  case CAPTURE_CYCLE: {
+    uint32_t length;
+    if (record->size != sizeof(length)) {
+      return false;
+    }
+    memcpy(&length, capture_record_data(record), sizeof(length));
+    advance_to(replay, record->frame);
+    replay->in_cycle = true;
+    replay->cycle_frame = record->frame;
+    replay->cycle_length = length;
+    return length > 0;
+  }
+
+  case CAPTURE_OUT:
+    if (replay->num_expected == replay->max_expected) {
+      const size_t max = replay->max_expected > 0 ? 2 * replay->max_expected : 256;
+      const capture_record_t **const expected = realloc(replay->expected, max * sizeof(*expected));
+      if (expected == NULL) {
+        return false;
+      }
+      replay->expected = expected;
+      replay->max_expected = max;
+    }
+    replay->expected[replay->num_expected++] = record;
+    ++replay->events_expected;
+    return true;
+
+  default: {
+    jack_port_t *const port = input_port(replay, record->source);
+    if (port == NULL || !replay->in_cycle || record->frame < replay->cycle_frame) {
+      return false;
+    }
+    // Inputs that didn't fit the buffer are not replayed, the
+    // differences show up in the output.
+    jack_midi_event_write(jack_port_get_buffer(port, replay->cycle_length),
+                          (jack_nframes_t) (record->frame - replay->cycle_frame),
+                          capture_record_data(record), record->size);
+    return true;
+  }
+  }
+}
+
+
+static int replay_capture(replay_t *replay, const uint8_t *data, size_t size) {
+  const uint8_t *position = data + sizeof(capture_header_t);
+  const uint8_t *const end = data + size;
+
+  while ((size_t) (end - position) >= sizeof(capture_record_t)) {
+    const capture_record_t *const record = (const capture_record_t *) position;
+    const size_t record_size = capture_record_size(record->size);
+    if ((size_t) (end - position) < record_size) {
+      fprintf(stderr, "The capture is truncated.\n");
+      break;
+    }
+    if (!handle_record(replay, record)) {
+      fprintf(stderr, "Invalid record at offset %zu.\n", (size_t) (position - data));
+      return -1;
+    }
+    position += record_size;
+  }
+  if (replay->in_cycle) {
+    run_cycle(replay, replay->cycle_length);
+  }
+  return 0;
+}
+
+
+static void print_summary(const replay_t *replay) {
+  const merger_process_stats_t *const stats = &replay->mm->process_stats;
+  uint64_t drops = 0;
+  for (int i = 0; i < DROP_REASON_COUNT; ++i) {
+    drops += stats->drops[i];
+  }
+
+  printf("cycles %" PRIu64 "\n", replay->cycles);
+  printf("events_in %" PRIu64 "\n", stats->events_in);
+  printf("events_out %" PRIu64 "\n", stats->events_out);
+  printf("events_recorded_out %" PRIu64 "\n", replay->events_expected);
+  printf("drops %" PRIu64 "\n", drops);
+  printf("cycles_differing %" PRIu64 "\n", replay->cycles_differing);
+  printf("ns_per_cycle %.1f\n",
+         replay->cycles > 0 ? (double) replay->process_ns / (double) replay->cycles : 0.0);
+}
+
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-r] [-v] <capture> [options]\n", name);
+}
+
+
+int main(int argc, char **argv) {
+  replay_t replay;
+  memset(&replay, 0, sizeof(replay));
+
+  int opt;
+  while ((opt = getopt(argc, argv, "rv")) != -1) {
+    switch (opt) {
+    case 'r':
+      replay.realtime = true;
+      break;
+    case 'v':
+      replay.verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *const path = argv[optind];
+
+  const int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  const size_t size = (size_t) st.st_size;
+  const uint8_t *const data = size >= sizeof(capture_header_t)
+                            ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  const capture_header_t *const header = (const capture_header_t *) data;
+  if (data == MAP_FAILED || memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0
+      || header->version != CAPTURE_VERSION || header->sample_rate == 0) {
+    fprintf(stderr, "%s is not a capture.\n", path);
+    return EXIT_FAILURE;
+  }
+
+  midi_merger_t *const mm = calloc(1, sizeof(midi_merger_t));
+  mm->config = malloc(sizeof(merger_config_t));
+  merger_config_init(mm->config);
+  if (merger_config_parse(mm->config, optind + 1 < argc ? argv[optind + 1] : NULL) != 0) {
+    return EXIT_FAILURE;
+  }
+  // Events are replayed as they were recorded.
+  mm->config->format = (merger_port_format_t) header->format;
+  mm->config_in_use = mm->config;
+  replay.mm = mm;
+  replay.sample_rate = header->sample_rate;
+  replay.buffer_size = header->buffer_size > 0 ? header->buffer_size : default_buffer_size;
+
+  // Only the log and the wakeups of the core are used by the callback.
+  rt_log_init(&replay.core.log);
+  sem_init(&replay.core.sem, 0, 0);
+  mm->core = &replay.core;
+  controller_slots_init(&mm->overflow_slots);
+  controller_slots_init(&mm->coalesce_slots);
+  controller_slots_init(&mm->throttle_slots);
+  mm->stats = merger_stats_create(NULL);
+  mm->sample_rate = header->sample_rate;
+  mm->clock_master = -1;
+  mm->spill_max_age = (jack_nframes_t) ((uint64_t) mm->config->spill_age_ms
+                                        * header->sample_rate / 1000);
+  for (int i = 0; i <= MAX_SOURCES; ++i) {
+    for (int cls = 0; cls < MSG_CLASS_COUNT; ++cls) {
+      rate_bucket_init(&mm->rate_buckets[i][cls]);
+    }
+  }
+  const size_t sysex_pool = mm->config->format == FORMAT_UMP ? 0 : (size_t) mm->config->sysex_pool;
+  mm->ports[PORT_IN] = mock_port_create(replay.buffer_size);
+  mm->ports[PORT_OUT] = mock_port_create(replay.buffer_size);
+  if (mm->stats == NULL || mm->ports[PORT_IN] == NULL || mm->ports[PORT_OUT] == NULL
+      || spill_queue_init(&mm->spill, (size_t) mm->config->spill, NULL) != 0
+      || spill_queue_init(&mm->sysex, sysex_pool, NULL) != 0) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  const int result = replay_capture(&replay, data, size);
+  print_summary(&replay);
+
+  for (int i = 0; i < mm->num_sources; ++i) {
+    mock_port_destroy(mm->sources[i].port);
+  }
+  mock_port_destroy(mm->ports[PORT_IN]);
+  mock_port_destroy(mm->ports[PORT_OUT]);
+  spill_queue_free(&mm->spill);
+  spill_queue_free(&mm->sysex);
+  merger_stats_destroy(mm->stats, NULL);
+  sem_destroy(&replay.core.sem);
+  munmap((void *) data, size);
+  free(replay.expected);
+  free(mm->config);
+  free(mm);
+
+  return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,75 @@
+#include "rt-arena.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static size_t page_size(void) {
+  return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+
+int rt_arena_init(rt_arena_t *arena, size_t size) {
+  memset(arena, 0, sizeof(rt_arena_t));
+
+  const size_t page = page_size();
+  size = (size + page - 1) / page * page;
+  void *const base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return -1;
+  }
+  arena->base = base;
+  arena->size = size;
+
+  // Locking faults the pages in. Without the permission to lock, at
+  // least touch them.
+  arena->lock_error = mlock(base, size) == 0 ? 0 : errno;
+  for (size_t offset = 0; offset < size; offset += page) {
+    ((volatile uint8_t *) base)[offset] = 0;
+  }
+  return 0;
+}
+
+
+void rt_arena_free(rt_arena_t *arena) {
+  if (arena->base != NULL) {
+    munmap(arena->base, arena->size);
+  }
+  memset(arena, 0, sizeof(rt_arena_t));
+}
+
+
+void *rt_arena_alloc(rt_arena_t *arena, size_t size) {
+  const size_t start = (arena->used + RT_ARENA_ALIGN - 1) & ~(size_t) (RT_ARENA_ALIGN - 1);
+  if (size > arena->size || start > arena->size - size) {
+    return NULL;
+  }
+  arena->used = start + size;
+  // Fresh anonymous pages, already zeroed.
+  return arena->base + start;
+}
+
+
+size_t rt_memory_missing_pages(const void *start, size_t size) {
+  const size_t page = page_size();
+  const uintptr_t first = (uintptr_t) start / page * page;
+  const size_t pages = ((uintptr_t) start + size - first + page - 1) / page;
+
+  unsigned char *const resident = malloc(pages);
+  if (resident == NULL || mincore((void *) first, pages * page, resident) != 0) {
+    free(resident);
+    return pages;
+  }
+
+  size_t missing = 0;
+  for (size_t i = 0; i < pages; ++i) {
+    if (!(resident[i] & 1)) {
+      ++missing;
+    }
+  }
+  free(resident);
+  return missing;
+}
@@ -0,0 +1,48 @@
+#ifndef RT_ARENA_H
+#define RT_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* alignment of allocations, a cache line */
+#define RT_ARENA_ALIGN 64
+
+/**
+ * One mapping for the state of a client, locked into memory and
+ * prefaulted, so the realtime thread never takes a page fault on it.
+ * Allocations are never given back, the whole arena is unmapped when
+ * the client goes away.
+ */
+typedef struct RT_ARENA_T {
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  // 0 or the error of `mlock()`, the pages are still prefaulted then.
+  int lock_error;
+} rt_arena_t;
+
+/**
+ * Map, lock and prefault at least `size` bytes. Returns 0 on success,
+ * locking may have failed though.
+ */
+int rt_arena_init(rt_arena_t *arena, size_t size);
+
+void rt_arena_free(rt_arena_t *arena);
+
+/**
+ * Return `size` zeroed bytes, or NULL if the arena is full.
+ */
+void *rt_arena_alloc(rt_arena_t *arena, size_t size);
+
+static inline bool rt_arena_contains(const rt_arena_t *arena, const void *start, size_t size) {
+  const uint8_t *const p = (const uint8_t *) start;
+  return arena->base != NULL && p >= arena->base && p + size <= arena->base + arena->size;
+}
+
+/**
+ * Count the pages of a range that are not in memory.
+ */
+size_t rt_memory_missing_pages(const void *start, size_t size);
+
+#endif
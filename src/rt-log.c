@@ -0,0 +1,155 @@
+#include "rt-log.h"
+
+#include <string.h>
+#include <time.h>
+
+#define RT_LOG_MASK (RT_LOG_SIZE - 1)
+
+/* messages by code, they take up to two integer arguments */
+static const char *const messages[LOG_CODE_COUNT] = {
+  [LOG_NO_BUFFER_SPACE] = "Not enough space for MIDI event.",
+  [LOG_WRITE_FAILED]    = "Could not write MIDI event (error %d).",
+  [LOG_QUEUE_FULL]      = "Connection queue full at port %d, rescanning ports.",
+  [LOG_OVERFLOW]        = "Output buffer full, low priority events dropped.",
+  [LOG_SPILL_FULL]      = "Spill queue full, MIDI event dropped.",
+  [LOG_CAPTURE_FULL]    = "Capture ring full, events not recorded.",
+};
+
+
+static uint64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+
+void rt_log_init(rt_log_t *log) {
+  memset(log, 0, sizeof(rt_log_t));
+  for (uint32_t i = 0; i < RT_LOG_SIZE; ++i) {
+    log->records[i].sequence = i;
+  }
+}
+
+
+bool rt_log(rt_log_t *log, rt_log_code_t code, int32_t arg0, int32_t arg1) {
+  if (__atomic_fetch_add(&log->repeats[code], 1, __ATOMIC_ACQ_REL) != 0) {
+    // The record is queued already.
+    return true;
+  }
+
+  rt_log_record_t *record;
+  uint32_t pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+
+  // Claim a record. Its sequence equals `pos` while it is free for
+  // this lap of the ring.
+  for (;;) {
+    record = &log->records[pos & RT_LOG_MASK];
+    const uint32_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+    const int32_t diff = (int32_t) (sequence - pos);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&log->head, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Full, the messages counted meanwhile are lost too.
+      const uint32_t count = __atomic_exchange_n(&log->repeats[code], 0, __ATOMIC_ACQ_REL);
+      __atomic_fetch_add(&log->lost, count, __ATOMIC_RELAXED);
+      return false;
+    } else {
+      pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  record->code = code;
+  record->args[0] = arg0;
+  record->args[1] = arg1;
+  __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+static void print_message(FILE *stream, rt_log_code_t code, const int32_t args[2],
+                          uint32_t repeats) {
+  char text[128];
+  snprintf(text, sizeof(text), messages[code], args[0], args[1]);
+
+  if (repeats > 0) {
+    fprintf(stream, "%s x %u in last second\n", text, repeats);
+  } else {
+    fprintf(stream, "%s\n", text);
+  }
+}
+
+
+bool rt_log_flush(rt_log_t *log, FILE *stream) {
+  const uint64_t now = now_ms();
+
+  for (;;) {
+    const uint32_t pos = log->tail;
+    rt_log_record_t *const record = &log->records[pos & RT_LOG_MASK];
+    if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+      // Empty.
+      break;
+    }
+
+    const rt_log_code_t code = (rt_log_code_t) record->code;
+    const int32_t args[2] = { record->args[0], record->args[1] };
+
+    // Hand the record back to the producers.
+    __atomic_store_n(&record->sequence, pos + RT_LOG_SIZE, __ATOMIC_RELEASE);
+    log->tail = pos + 1;
+
+    if (code >= LOG_CODE_COUNT) {
+      continue;
+    }
+
+    // The message and its repeats, the next one queues a record again.
+    const uint32_t count = __atomic_exchange_n(&log->repeats[code], 0, __ATOMIC_ACQ_REL);
+
+    rt_log_window_t *const window = &log->windows[code];
+    if (window->active && now - window->since_ms < RT_LOG_WINDOW_MS) {
+      window->suppressed += count;
+      window->args[0] = args[0];
+      window->args[1] = args[1];
+      continue;
+    }
+
+    if (window->active && window->suppressed > 0) {
+      print_message(stream, code, window->args, window->suppressed);
+    }
+    print_message(stream, code, args, 0);
+    window->active = true;
+    window->since_ms = now;
+    window->args[0] = args[0];
+    window->args[1] = args[1];
+    window->suppressed = count > 0 ? count - 1 : 0;
+  }
+
+  const uint32_t lost = __atomic_exchange_n(&log->lost, 0, __ATOMIC_RELAXED);
+  if (lost > 0) {
+    fprintf(stream, "%u log messages lost.\n", lost);
+  }
+
+  // Close the windows that are over.
+  bool pending = false;
+  for (int code = 0; code < LOG_CODE_COUNT; ++code) {
+    rt_log_window_t *const window = &log->windows[code];
+    if (!window->active) {
+      continue;
+    }
+    if (now - window->since_ms >= RT_LOG_WINDOW_MS) {
+      if (window->suppressed > 0) {
+        print_message(stream, (rt_log_code_t) code, window->args, window->suppressed);
+      }
+      window->active = false;
+      window->suppressed = 0;
+    } else if (window->suppressed > 0) {
+      pending = true;
+    }
+  }
+
+  fflush(stream);
+  return pending;
+}
@@ -0,0 +1,80 @@
+#ifndef RT_LOG_H
+#define RT_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* number of records in the ring, has to be a power of two */
+#define RT_LOG_SIZE 256
+
+/* repeated messages are coalesced within this window */
+#define RT_LOG_WINDOW_MS 1000
+
+typedef enum RT_LOG_CODE {
+    LOG_NO_BUFFER_SPACE,
+    LOG_WRITE_FAILED,
+    LOG_QUEUE_FULL,
+    LOG_OVERFLOW,
+    LOG_SPILL_FULL,
+    LOG_CAPTURE_FULL,
+    LOG_CODE_COUNT // this is not used as a code
+} rt_log_code_t;
+
+typedef struct RT_LOG_RECORD_T {
+  uint32_t sequence;
+  uint32_t code;
+  int32_t args[2];
+} rt_log_record_t;
+
+/**
+ * Consumer side state of one message code.
+ */
+typedef struct RT_LOG_WINDOW_T {
+  bool active;
+  uint64_t since_ms;
+  uint32_t suppressed;
+  int32_t args[2];
+} rt_log_window_t;
+
+/**
+ * A bounded lock-free ring of fixed-size log records.
+ *
+ * Any thread may write records with `rt_log()` without blocking or
+ * allocating, a single non-realtime thread formats and prints them
+ * with `rt_log_flush()`. Repeats are coalesced by the writers: only the
+ * first message of a code goes into the ring, the ones until it is
+ * printed just count, so a burst takes one record.
+ */
+typedef struct RT_LOG_T {
+  rt_log_record_t records[RT_LOG_SIZE];
+  uint32_t head;
+  uint32_t tail;
+  uint32_t lost;
+
+  // Messages per code since its record was queued, 0 if none is.
+  uint32_t repeats[LOG_CODE_COUNT];
+
+  rt_log_window_t windows[LOG_CODE_COUNT];
+} rt_log_t;
+
+void rt_log_init(rt_log_t *log);
+
+/**
+ * Queue a message, or count it if one of the same code is queued
+ * already; its arguments are the ones of the first. It is safe to call
+ * from the realtime context. Returns false if the ring is full and the
+ * message was lost.
+ */
+bool rt_log(rt_log_t *log, rt_log_code_t code, int32_t arg0, int32_t arg1);
+
+/**
+ * Print all queued messages to `stream`. Repeats of a message within
+ * `RT_LOG_WINDOW_MS` are counted and printed as one summary line when
+ * the window is over. It is called in the non-realtime context.
+ * Returns true if summaries are pending, then it has to be called
+ * again after the window is over.
+ */
+bool rt_log_flush(rt_log_t *log, FILE *stream);
+
+#endif
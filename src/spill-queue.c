@@ -0,0 +1,97 @@
+#include "spill-queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* events are at least this big on average, it sizes the event array */
+#define MIN_EVENT_SIZE 3
+
+
+int spill_queue_init(spill_queue_t *queue, size_t bytes, rt_arena_t *arena) {
+  memset(queue, 0, sizeof(spill_queue_t));
+  if (bytes == 0) {
+    return 0;
+  }
+
+  queue->max_events = (uint32_t) (bytes / MIN_EVENT_SIZE + 1);
+  queue->data_size = (uint32_t) bytes;
+  if (arena != NULL) {
+    queue->in_arena = true;
+    queue->events = rt_arena_alloc(arena, queue->max_events * sizeof(spill_event_t));
+    queue->data = rt_arena_alloc(arena, bytes);
+  } else {
+    queue->events = calloc(queue->max_events, sizeof(spill_event_t));
+    queue->data = calloc(bytes, 1);
+  }
+  if (queue->events == NULL || queue->data == NULL) {
+    spill_queue_free(queue);
+    return -1;
+  }
+  return 0;
+}
+
+
+size_t spill_queue_memory(size_t bytes) {
+  if (bytes == 0) {
+    return 0;
+  }
+  return (bytes / MIN_EVENT_SIZE + 1) * sizeof(spill_event_t) + bytes + 2 * RT_ARENA_ALIGN;
+}
+
+
+void spill_queue_free(spill_queue_t *queue) {
+  if (!queue->in_arena) {
+    free(queue->events);
+    free(queue->data);
+  }
+  memset(queue, 0, sizeof(spill_queue_t));
+}
+
+
+bool spill_queue_push(spill_queue_t *queue, uint64_t due,
+                      const uint8_t *data, size_t size) {
+  if (queue->count == queue->max_events || size == 0 || size > queue->data_size) {
+    return false;
+  }
+
+  // Find a contiguous range in the pool. Data is used in FIFO order
+  // too, the oldest event marks the start of the used range.
+  uint32_t offset;
+  if (queue->count == 0) {
+    offset = 0;
+  } else {
+    const uint32_t tail = queue->events[queue->head].offset;
+    if (queue->data_head > tail) {
+      if (queue->data_head + size <= queue->data_size) {
+        offset = queue->data_head;
+      } else if (size <= tail) {
+        offset = 0;
+      } else {
+        return false;
+      }
+    } else if (queue->data_head + size <= tail) {
+      offset = queue->data_head;
+    } else {
+      return false;
+    }
+  }
+
+  spill_event_t *const event = &queue->events[(queue->head + queue->count) % queue->max_events];
+  event->due = due;
+  event->offset = offset;
+  event->size = (uint32_t) size;
+  memcpy(queue->data + offset, data, size);
+
+  queue->data_head = offset + (uint32_t) size;
+  ++queue->count;
+  return true;
+}
+
+
+void spill_queue_pop(spill_queue_t *queue) {
+  if (queue->count == 0) {
+    return;
+  }
+  queue->head = (queue->head + 1) % queue->max_events;
+  --queue->count;
+}
@@ -0,0 +1,66 @@
+#ifndef SPILL_QUEUE_H
+#define SPILL_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rt-arena.h"
+
+typedef struct SPILL_EVENT_T {
+  // Frame the event was due at, counted from the client start.
+  uint64_t due;
+  uint32_t offset;
+  uint32_t size;
+} spill_event_t;
+
+/**
+ * A FIFO of MIDI events carried over to the next cycle. Event data is
+ * kept in a preallocated byte pool, so push and pop don't allocate.
+ * It is used by the realtime thread only.
+ */
+typedef struct SPILL_QUEUE_T {
+  spill_event_t *events;
+  uint32_t max_events;
+  uint32_t head;
+  uint32_t count;
+
+  uint8_t *data;
+  uint32_t data_size;
+  uint32_t data_head;
+
+  // The memory comes from an arena and is not freed.
+  bool in_arena;
+} spill_queue_t;
+
+/**
+ * Allocate a queue for `bytes` of event data, from `arena` unless it
+ * is NULL. Returns 0 on success.
+ */
+int spill_queue_init(spill_queue_t *queue, size_t bytes, rt_arena_t *arena);
+
+/**
+ * The memory `spill_queue_init()` allocates for `bytes` of event data.
+ */
+size_t spill_queue_memory(size_t bytes);
+
+void spill_queue_free(spill_queue_t *queue);
+
+/**
+ * Append an event. Returns false if the queue is full.
+ */
+bool spill_queue_push(spill_queue_t *queue, uint64_t due,
+                      const uint8_t *data, size_t size);
+
+static inline const spill_event_t *spill_queue_front(const spill_queue_t *queue) {
+  return queue->count > 0 ? &queue->events[queue->head] : NULL;
+}
+
+static inline const uint8_t *spill_queue_data(const spill_queue_t *queue,
+                                              const spill_event_t *event) {
+  return queue->data + event->offset;
+}
+
+void spill_queue_pop(spill_queue_t *queue);
+
+#endif
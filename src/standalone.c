@@ -0,0 +1,178 @@
+#include "standalone.h"
+#include "midi-client.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <jack/jack.h>
+
+/*
+ * The standalone clients sleep in poll() on two descriptors and wake up
+ * for nothing else: a signalfd for SIGINT and SIGTERM and an eventfd
+ * the shutdown callback of Jack writes to. The signals are blocked
+ * before any thread starts, so they all end up in the signalfd.
+ */
+
+/* wait between attempts to reach a server that went away, doubled up
+   to the maximum */
+#define RECONNECT_MIN_MS 250
+#define RECONNECT_MAX_MS 5000
+
+typedef enum STANDALONE_EVENT {
+    EVENT_SIGNAL,
+    EVENT_SERVER_GONE,
+    EVENT_TIMEOUT,
+    EVENT_ERROR
+} standalone_event_t;
+
+
+static void server_shutdown(void *arg) {
+  const int fd = *(const int *) arg;
+  const uint64_t one = 1;
+  // Nothing to do if it fails, the counter is not zero then.
+  if (write(fd, &one, sizeof(one)) < 0) {
+    return;
+  }
+}
+
+
+/**
+ * Sleep until a signal, the server shutdown or `timeout_ms`, -1 for
+ * none.
+ */
+static standalone_event_t wait_event(int signal_fd, int shutdown_fd, int timeout_ms) {
+  struct pollfd fds[2] = {
+    { .fd = signal_fd, .events = POLLIN },
+    { .fd = shutdown_fd, .events = POLLIN },
+  };
+
+  for (;;) {
+    const int rc = poll(fds, 2, timeout_ms);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc < 0) {
+      fprintf(stderr, "Can't wait for events: %s\n", strerror(errno));
+      return EVENT_ERROR;
+    }
+    if (rc == 0) {
+      return EVENT_TIMEOUT;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        fprintf(stderr, "Got %s, stopping.\n", strsignal((int) info.ssi_signo));
+      }
+      return EVENT_SIGNAL;
+    }
+    uint64_t count;
+    if (read(shutdown_fd, &count, sizeof(count)) < 0) {
+      fprintf(stderr, "Can't read the shutdown event: %s\n", strerror(errno));
+      return EVENT_ERROR;
+    }
+    return EVENT_SERVER_GONE;
+  }
+}
+
+
+static jack_client_t *open_client(const char *name, bool quiet) {
+  jack_status_t status;
+  jack_client_t *const client = jack_client_open(name, JackNoStartServer, &status);
+  if (client == NULL && !quiet) {
+    fprintf(stderr, "Opening client failed. Status is %d.\n", status);
+    if (status & JackServerFailed) {
+      fprintf(stderr, "Unable to connect to Jack server.\n");
+    }
+  }
+  return client;
+}
+
+
+/**
+ * Stop and close the client and report what it did.
+ */
+static void finish_client(jack_client_t *client, midi_client_t *mc) {
+  midi_client_stop(mc);
+  midi_client_print_stats(mc, stdout);
+  fflush(stdout);
+  midi_client_free(mc);
+  jack_client_close(client);
+}
+
+
+int standalone_main(const char *name, int argc, char **argv) {
+  const char *const options = argc > 1 ? argv[1] : "";
+
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+    fprintf(stderr, "Can't block signals\n");
+    return EXIT_FAILURE;
+  }
+  const int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (signal_fd < 0 || shutdown_fd < 0) {
+    fprintf(stderr, "Can't create event descriptors: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  int result = EXIT_SUCCESS;
+  bool reconnecting = false;
+  int retry_ms = RECONNECT_MIN_MS;
+
+  for (;;) {
+    jack_client_t *const client = open_client(name, reconnecting);
+    if (client == NULL) {
+      if (!reconnecting) {
+        result = EXIT_FAILURE;
+        break;
+      }
+      // Wait for the server to come back.
+      const standalone_event_t event = wait_event(signal_fd, shutdown_fd, retry_ms);
+      if (event == EVENT_SIGNAL || event == EVENT_ERROR) {
+        result = event == EVENT_ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+        break;
+      }
+      retry_ms = retry_ms * 2 < RECONNECT_MAX_MS ? retry_ms * 2 : RECONNECT_MAX_MS;
+      continue;
+    }
+
+    // It has to be set before the client is activated.
+    jack_on_shutdown(client, server_shutdown, &shutdown_fd);
+    midi_client_t *const mc = midi_client_create(client, options);
+    if (mc == NULL) {
+      jack_client_close(client);
+      result = EXIT_FAILURE;
+      break;
+    }
+    if (reconnecting) {
+      fprintf(stderr, "Connected to the Jack server again.\n");
+    }
+
+    const standalone_event_t event = wait_event(signal_fd, shutdown_fd, -1);
+    finish_client(client, mc);
+    if (event != EVENT_SERVER_GONE) {
+      result = event == EVENT_ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+      break;
+    }
+    fprintf(stderr, "The Jack server is gone, waiting for it.\n");
+    reconnecting = true;
+    retry_ms = RECONNECT_MIN_MS;
+  }
+
+  close(shutdown_fd);
+  close(signal_fd);
+  return result;
+}
@@ -0,0 +1,12 @@
+#ifndef STANDALONE_H
+#define STANDALONE_H
+
+/**
+ * Run the client `name` outside of the Jack server until SIGINT or
+ * SIGTERM, with the options from the first argument. If the server
+ * goes away the client waits for it and comes back. Returns the exit
+ * status of the program.
+ */
+int standalone_main(const char *name, int argc, char **argv);
+
+#endif
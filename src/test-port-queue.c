@@ -0,0 +1,96 @@
+#include "port-queue.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Stress test of the port queue: one thread pushes sequenced records
+ * as fast as it can, another pops them in bulks of varying size and
+ * checks that every record arrives once, in order and intact.
+ */
+
+/* records pushed, enough to wrap the counters of the ring many times */
+#define RECORDS 10000000u
+
+static port_queue_t queue;
+
+
+/**
+ * The record with sequence number `i`. Ids start at 0 and go past 255,
+ * the flags and times differ in every bit from their neighbours.
+ */
+static port_event_t expected(uint32_t i) {
+  const port_event_t event = {
+    .id = i,
+    .flags = ~i,
+    .kind = i % PORT_EVENT_KIND_COUNT,
+    .time_ns = (uint64_t) i * 0x9e3779b97f4a7c15ull,
+  };
+  return event;
+}
+
+
+static void *produce(void *arg) {
+  for (uint32_t i = 0; i < RECORDS; ++i) {
+    const port_event_t event = expected(i);
+    while (!port_queue_push(&queue, event.id, event.flags, (port_event_kind_t) event.kind,
+                            event.time_ns)) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+
+int main(int argc, char **argv) {
+  port_queue_init(&queue);
+
+  pthread_t producer;
+  if (pthread_create(&producer, NULL, produce, NULL) != 0) {
+    fprintf(stderr, "Can't create producer thread\n");
+    return EXIT_FAILURE;
+  }
+
+  port_event_t events[PORT_QUEUE_SIZE];
+  uint32_t next = 0;
+  uint64_t bulks = 0;
+  uint64_t errors = 0;
+  size_t max = 1;
+
+  while (next < RECORDS) {
+    const size_t count = port_queue_pop_bulk(&queue, events, max);
+    if (count == 0) {
+      sched_yield();
+      continue;
+    }
+    ++bulks;
+    for (size_t i = 0; i < count; ++i, ++next) {
+      const port_event_t want = expected(next);
+      const port_event_t *const got = &events[i];
+      if (got->id != want.id || got->flags != want.flags || got->kind != want.kind
+          || got->time_ns != want.time_ns) {
+        if (errors++ < 10) {
+          fprintf(stderr, "Record %" PRIu32 " is id %" PRIu32 " flags %" PRIx32
+                  " kind %" PRIu32 " time %" PRIu64 ".\n",
+                  next, got->id, got->flags, got->kind, got->time_ns);
+        }
+      }
+    }
+    // Bulks from a single record up to the whole ring.
+    max = max % PORT_QUEUE_SIZE + 1;
+  }
+  pthread_join(producer, NULL);
+
+  if (!port_queue_empty(&queue)) {
+    fprintf(stderr, "Records left over.\n");
+    ++errors;
+  }
+
+  printf("records %" PRIu32 "\n", next);
+  printf("bulks %" PRIu64 "\n", bulks);
+  printf("errors %" PRIu64 "\n", errors);
+  return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
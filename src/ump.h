@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* --------------------------------------------------------------------- */
+// MIDI 2.0 Universal MIDI Packets, as native 32-bit words
+
+/* the longest packet, in bytes */
+#define UMP_MAX_PACKET_SIZE 16
+
+/* message types */
+#define UMP_UTILITY 0x0
+#define UMP_SYSTEM 0x1
+#define UMP_MIDI1_CHANNEL_VOICE 0x2
+#define UMP_SYSEX7 0x3
+#define UMP_MIDI2_CHANNEL_VOICE 0x4
+
+static inline
+unsigned ump_message_type(uint32_t word)
+{
+    return word >> 28;
+}
+
+static inline
+unsigned ump_group(uint32_t word)
+{
+    return (word >> 24) & 0x0f;
+}
+
+/**
+ * Size of a packet in bytes, given by the type in its first word.
+ */
+static inline
+size_t ump_packet_size(uint32_t word)
+{
+    static const uint8_t sizes[16] = {
+        4, 4, 4, 8, 8, 16, 4, 4, 8, 8, 8, 12, 12, 16, 16, 16
+    };
+    return sizes[ump_message_type(word)];
+}
+
+/**
+ * The MIDI 1.0 message a packet stands for, as far as classification
+ * and the filter rules are concerned: status, group aside, and data
+ * bytes. MIDI 2.0 values are scaled down to 7 bits, a MIDI 2.0 Note On
+ * never becomes velocity 0. SysEx is just its status byte. Returns the
+ * size of the view, 0 for packets without a MIDI 1.0 counterpart,
+ * e.g. utility messages or per-note controllers.
+ */
+static inline
+size_t ump_midi1_view(const uint32_t* words, size_t size, uint8_t view[3])
+{
+    if (size < 4 || size < ump_packet_size(words[0]))
+        return 0;
+
+    const uint32_t word = words[0];
+    const uint8_t status = (uint8_t) (word >> 16);
+    view[0] = status;
+    view[1] = (uint8_t) ((word >> 8) & 0x7f);
+    view[2] = (uint8_t) (word & 0x7f);
+
+    switch (ump_message_type(word))
+    {
+    case UMP_SYSTEM:
+        if (status == 0xf2)
+            return 3;
+        return (status == 0xf1 || status == 0xf3) ? 2 : 1;
+
+    case UMP_MIDI1_CHANNEL_VOICE:
+        return ((status & 0xf0) == 0xc0 || (status & 0xf0) == 0xd0) ? 2 : 3;
+
+    case UMP_SYSEX7:
+        view[0] = 0xf0;
+        return 1;
+
+    case UMP_MIDI2_CHANNEL_VOICE: {
+        const uint32_t value = words[1];
+        switch (status & 0xf0)
+        {
+        case 0x80:
+        case 0x90:
+            view[2] = (uint8_t) (value >> 25);
+            if ((status & 0xf0) == 0x90 && view[2] == 0)
+                view[2] = 1;
+            return 3;
+        case 0xa0:
+        case 0xb0:
+            view[2] = (uint8_t) (value >> 25);
+            return 3;
+        case 0xc0:
+            view[1] = (uint8_t) ((value >> 24) & 0x7f);
+            return 2;
+        case 0xd0:
+            view[1] = (uint8_t) (value >> 25);
+            return 2;
+        case 0xe0:
+            view[1] = (uint8_t) ((value >> 18) & 0x7f);
+            view[2] = (uint8_t) (value >> 25);
+            return 3;
+        default:
+            return 0;
+        }
+    }
+
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Write the status and note number of a view that went through the
+ * filter rules back to a channel voice packet. Values keep their full
+ * resolution.
+ */
+static inline
+void ump_apply_view(uint32_t* words, const uint8_t view[3])
+{
+    const unsigned type = ump_message_type(words[0]);
+    if (type != UMP_MIDI1_CHANNEL_VOICE && type != UMP_MIDI2_CHANNEL_VOICE)
+        return;
+
+    uint32_t word = (words[0] & 0xff00ffff) | ((uint32_t) view[0] << 16);
+    if ((view[0] & 0xf0) <= 0xa0)
+        word = (word & 0xffff80ff) | ((uint32_t) view[1] << 8);
+    words[0] = word;
+}
+
+/**
+ * A MIDI 1.0 channel voice message as a packet of group 1.
+ */
+static inline
+uint32_t ump_from_midi1(const uint8_t data[3])
+{
+    return ((uint32_t) UMP_MIDI1_CHANNEL_VOICE << 28)
+         | ((uint32_t) data[0] << 16) | ((uint32_t) data[1] << 8) | data[2];
+}